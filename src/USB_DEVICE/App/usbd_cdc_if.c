@@ -98,6 +98,19 @@ uint8_t UserTxBufferHS[APP_TX_DATA_SIZE];
 
 uint8_t CdcLineCodingBuf[8];
 
+// Transmissions requested while the IN endpoint was busy, sent from CDC_TransmitCplt_HS.
+// Room for every interrupt response buffer plus a main-loop response.
+#define CDC_TX_PENDING_MAX 8
+static uint8_t  *CdcTxPendingBuf[CDC_TX_PENDING_MAX];
+static uint16_t  CdcTxPendingLen[CDC_TX_PENDING_MAX];
+static uint32_t  CdcTxPendingHead;
+static volatile uint32_t CdcTxPendingCount;
+
+// Received bytes not parsed yet because every response buffer was in flight.
+// The OUT endpoint is not re-armed until they are, so the host is held off.
+static uint8_t  *CdcRxRestBuf;
+static uint32_t  CdcRxRestLen;
+
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -132,6 +145,8 @@ static int8_t CDC_TransmitCplt_HS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
 
+static void CDC_ParseRx_HS(void);
+
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
 /**
@@ -159,6 +174,11 @@ static int8_t CDC_Init_HS(void)
   /* Set Application Buffers */
   USBD_CDC_SetTxBuffer(&hUsbDeviceHS, UserTxBufferHS, 0);
   USBD_CDC_SetRxBuffer(&hUsbDeviceHS, UserRxBufferHS);
+  // anything in flight was lost with the previous configuration
+  CdcTxPendingHead = 0;
+  CdcTxPendingCount = 0;
+  CdcRxRestLen = 0;
+  comms_usb_hpt_tx_abort();
   return (USBD_OK);
   /* USER CODE END 8 */
 }
@@ -279,19 +299,11 @@ static int8_t CDC_Control_HS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_HS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 11 */
-  if (Len) {
-    //USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
-    HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
-
-    void *send_data = NULL;
-    uint32_t send_len = 0;
-    comms_usb_hpt_receive_bytes(Buf, *Len, &send_data, &send_len);
-
-    if (send_data != NULL && send_len != 0)
-      CDC_Transmit_HS(send_data, send_len);
-  }
+  CdcRxRestBuf = Buf;
+  CdcRxRestLen = Len ? *Len : 0;
+  HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+  CDC_ParseRx_HS();
   HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
-  USBD_CDC_ReceivePacket(&hUsbDeviceHS);
   return (USBD_OK);
   /* USER CODE END 11 */
 }
@@ -338,12 +350,77 @@ static int8_t CDC_TransmitCplt_HS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
   UNUSED(Buf);
   UNUSED(Len);
   UNUSED(epnum);
+  if (CdcTxPendingCount > 0) {
+    uint8_t *buf = CdcTxPendingBuf[CdcTxPendingHead];
+    uint16_t len = CdcTxPendingLen[CdcTxPendingHead];
+    CdcTxPendingHead = (CdcTxPendingHead + 1) % CDC_TX_PENDING_MAX;
+    CdcTxPendingCount--;
+    CDC_Transmit_HS(buf, len);
+  }
+  // Buf is free again; it may be what the held-off received bytes were waiting for
+  comms_usb_hpt_tx_done(Buf);
+  if (CdcRxRestLen > 0)
+    CDC_ParseRx_HS();
   /* USER CODE END 14 */
   return result;
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
+/**
+  * @brief  Parse the received bytes not parsed yet, re-arming the OUT endpoint once all are
+  *
+  *         @note
+  *         Runs in the USB interrupt.
+  */
+static void CDC_ParseRx_HS(void)
+{
+  uint32_t used = comms_usb_hpt_receive_bytes(CdcRxRestBuf, CdcRxRestLen);
+  CdcRxRestBuf += used;
+  CdcRxRestLen -= used;
+  if (CdcRxRestLen == 0)
+    USBD_CDC_ReceivePacket(&hUsbDeviceHS);
+}
+
+/**
+  * @brief  Transmit, or queue the buffer to be sent when the current transmission completes
+  *
+  *         @note
+  *         Must be called from the USB interrupt or with OTG_HS_IRQn disabled.
+  *         Buf must remain valid until it has been sent.
+  *
+  * @param  Buf: Buffer of data to be sent
+  * @param  Len: Number of data to be sent (in bytes)
+  * @retval USBD_OK if sent or queued, USBD_BUSY if the queue is full, else USBD_FAIL
+  */
+uint8_t CDC_TransmitOrQueue_HS(uint8_t* Buf, uint16_t Len)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceHS.pClassData;
+  if (hcdc == NULL)
+    return USBD_FAIL;
+  if (hcdc->TxState == 0 && CdcTxPendingCount == 0)
+    return CDC_Transmit_HS(Buf, Len);
+  if (CdcTxPendingCount >= CDC_TX_PENDING_MAX)
+    return USBD_BUSY;
+  uint32_t tail = (CdcTxPendingHead + CdcTxPendingCount) % CDC_TX_PENDING_MAX;
+  CdcTxPendingBuf[tail] = Buf;
+  CdcTxPendingLen[tail] = Len;
+  CdcTxPendingCount++;
+  return USBD_OK;
+}
+
+/**
+  * @brief  Check whether all requested transmissions have completed
+  * @retval 1 if idle, else 0
+  */
+uint8_t CDC_IsTxIdle_HS(void)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceHS.pClassData;
+  if (hcdc == NULL)
+    return 1;
+  return hcdc->TxState == 0 && CdcTxPendingCount == 0;
+}
+
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 /**
@@ -109,6 +109,9 @@ uint8_t CDC_Transmit_HS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
 
+uint8_t CDC_TransmitOrQueue_HS(uint8_t* Buf, uint16_t Len);
+uint8_t CDC_IsTxIdle_HS(void);
+
 /* USER CODE END EXPORTED_FUNCTIONS */
 
 /**
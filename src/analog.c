@@ -73,8 +73,15 @@ DacError DacWriteOutput(uint32_t unit, uint32_t counts)
     DacError ret = DAC_SUCCESS;
 
     GPIO_PinState dac_err_state = HAL_GPIO_ReadPin(ANA_ERR_GPIO_Port, ANA_ERR_Pin);
-    if (dac_err_state == GPIO_PIN_SET)
+    if (dac_err_state == GPIO_PIN_SET) {
+        // the output is unknown after a fault: don't skip the next write
+        if (unit == 1) {
+            gDac1.Known = 0;
+        } else if (unit == 2) {
+            gDac2.Known = 0;
+        }
         return DAC_ERR_HW;
+    }
 
     GPIO_PinState dac_ack_state = HAL_GPIO_ReadPin(ANA_ACK_GPIO_Port, ANA_ACK_Pin);
     while (dac_ack_state == GPIO_PIN_SET) // TODO: timeout
@@ -104,6 +111,86 @@ DacError DacWriteOutput(uint32_t unit, uint32_t counts)
             gDac2.ActiveCounts = counts;
         }
     }
+    // after a failed write the output is unknown: don't skip the next one
+    if (unit == 1) {
+        gDac1.Known = ret == DAC_SUCCESS;
+    } else if (unit == 2) {
+        gDac2.Known = ret == DAC_SUCCESS;
+    }
 
     return ret;
 }
+
+// Used while no settling model is set; about the old fixed delay
+#define DAC_SETTLE_DEFAULT_US 100
+
+static DacVariables *dac_unit(uint32_t unit)
+{
+    switch (unit) {
+        case 1: return &gDac1;
+        case 2: return &gDac2;
+        default: return NULL;
+    }
+}
+
+/**
+ * @brief Settling time of a step, from the unit's settling model
+ *
+ * @param dac   Unit
+ * @param scale Counts per calibrated count (128 for unit 1, 64 for unit 2)
+ * @param from  Counts before the step
+ * @param to    Counts after the step
+ */
+static uint32_t dac_settle_us(const DacVariables *dac, float scale, uint32_t from, uint32_t to)
+{
+    if (dac->SettleC0 == 0.0f && dac->SettleC1 == 0.0f)
+        return DAC_SETTLE_DEFAULT_US;
+
+    float step_counts = from > to ? from - to : to - from;
+    float step_mv = dac->CalC1 != 0.0f ? step_counts / (scale * dac->CalC1) : 0.0f;
+    float us = dac->SettleC0 + dac->SettleC1 * (step_mv < 0.0f ? -step_mv : step_mv);
+    return us > 0.0f ? (uint32_t)us : 0;
+}
+
+/**
+ * @brief Set a DAC output, skipping the write if it already outputs counts
+ *
+ * @param unit      1 (RESET#/Vwl) or 2 (WP#/ACC)
+ * @param counts    Output counts
+ * @param settle_us If not NULL, set to how long to wait for the output to
+ *                  settle: 0 if unchanged, else from the unit's settling model
+ * @return DacError
+ */
+DacError DacSetOutput(uint32_t unit, uint32_t counts, uint32_t *settle_us)
+{
+    DacVariables *dac = dac_unit(unit);
+    if (settle_us)
+        *settle_us = 0;
+    if (dac == NULL)
+        return DAC_ERR_INVALID_CHANNEL;
+
+    if (dac->Known && dac->ActiveCounts == counts)
+        return DAC_SUCCESS;
+
+    // step from an unknown output is taken as from 0
+    uint32_t from = dac->Known ? dac->ActiveCounts : 0;
+    DacError err = DacWriteOutput(unit, counts);
+    if (err == DAC_SUCCESS && settle_us)
+        *settle_us = dac_settle_us(dac, unit == 1 ? 128.0f : 64.0f, from, counts);
+    return err;
+}
+
+/**
+ * @brief Set a unit's settling model: SettleC0 + SettleC1 * step in mV, in us
+ *
+ * Both 0 selects the default fixed settling time.
+ */
+DacError DacSetSettle(uint32_t unit, float SettleC0, float SettleC1)
+{
+    DacVariables *dac = dac_unit(unit);
+    if (dac == NULL)
+        return DAC_ERR_INVALID_CHANNEL;
+    dac->SettleC0 = SettleC0;
+    dac->SettleC1 = SettleC1;
+    return DAC_SUCCESS;
+}
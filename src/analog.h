@@ -17,11 +17,15 @@ extern "C"
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct {
     uint32_t ActiveCounts;
-    float    CalC0; // DAC calibration constant coefficient
-    float    CalC1; // DAC calibration linear coefficient
+    uint32_t Known;    // ActiveCounts is what the DAC outputs (last write succeeded)
+    float    CalC0;    // DAC calibration constant coefficient
+    float    CalC1;    // DAC calibration linear coefficient
+    float    SettleC0; // settling time constant, us (0 with SettleC1 0 = default)
+    float    SettleC1; // settling time per mV of step, us
 } DacVariables;
 
 extern DacVariables gDac1; // DAC 1
@@ -39,14 +43,18 @@ typedef enum {
 
 extern DacError DacInit(float Dac1CalC0, float Dac1CalC1, float Dac2CalC0, float Dac2CalC1);
 extern DacError DacWriteOutput(uint32_t unit, uint32_t counts);
+extern DacError DacSetOutput(uint32_t unit, uint32_t counts, uint32_t *settle_us);
+extern DacError DacSetSettle(uint32_t unit, float SettleC0, float SettleC1);
 
 // #define			SET_RESET_VOLTAGE(V)		gDac.ActiveCountsReset = (uint16_t)(gRamConfig.Ana_Reset10VCnts * ((float)(V)/10.0))
 // #define			SET_WP_ACC_VOLTAGE(V)		gDac.ActiveCountsWpAcc = (uint16_t)(gRamConfig.Ana_WpAcc10VCnts * ((float)(V)/10.0))
 
 #define DAC1_CALIBRATED(V) (gDac1.CalC0 + gDac1.CalC1*((float)(V)))
 #define DAC2_CALIBRATED(V) (gDac2.CalC0 + gDac2.CalC1*((float)(V)))
-#define SET_RESET_MV(V) DacWriteOutput(1, DAC1_CALIBRATED(V)*128)
-#define SET_WP_ACC_MV(V) DacWriteOutput(2, DAC2_CALIBRATED(V)*(128/2))
+#define DAC1_COUNTS(V) (DAC1_CALIBRATED(V)*128)
+#define DAC2_COUNTS(V) (DAC2_CALIBRATED(V)*(128/2))
+#define SET_RESET_MV(V) DacSetOutput(1, DAC1_COUNTS(V), NULL)
+#define SET_WP_ACC_MV(V) DacSetOutput(2, DAC2_COUNTS(V), NULL)
 
 #define WP_ACC_LOW SET_WP_ACC_MV(0)
 #define WP_ACC_HIGH SET_WP_ACC_MV(3300)
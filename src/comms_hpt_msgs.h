@@ -72,12 +72,43 @@ typedef enum __attribute__((__packed__))
 	HPT_CFG_FLASH_DEV_INFO_CMD		= 38,			// get interface FPGA configuration flash device info
 	HPT_CFG_FLASH_DEV_INFO_RSP		= 39,
 
+	HPT_VT_SWEEP_CMD				= 40,			// count 1 bits in a region at each step of a Vt sweep
+	HPT_VT_SWEEP_RSP				= 41,
+	HPT_VT_MAP_CMD					= 42,			// find per-cell Vt codes by bisection
+	HPT_VT_MAP_RSP					= 43,
+	HPT_FIND_FLIPS_CMD				= 44,			// list words differing from an expected pattern
+	HPT_FIND_FLIPS_RSP				= 45,
+	HPT_FINGERPRINT_CHIP_CMD		= 46,			// CRC of each sector, to find sectors which changed
+	HPT_FINGERPRINT_CHIP_RSP		= 47,
+	HPT_READ_DATA_RLE_CMD			= 48,			// read up to a sector, run-length encoded
+	HPT_READ_DATA_RLE_RSP			= 49,
+	HPT_BATCH_CMD					= 50,			// run several commands in order, in one round trip
+	HPT_BATCH_RSP					= 51,
+	HPT_JOB_STATUS_CMD				= 52,			// state, progress and timing of a queued command
+	HPT_JOB_STATUS_RSP				= 53,
+	HPT_JOB_RESULT_CMD				= 54,			// response of a finished queued command
+	HPT_JOB_RESULT_RSP				= 55,			// not sent: the job's own response is returned
+	HPT_JOB_CANCEL_CMD				= 56,			// cancel a queued or running command
+	HPT_JOB_CANCEL_RSP				= 57,
+	HPT_DIAG_ISR_CMD				= 58,			// USB interrupt residency
+	HPT_DIAG_ISR_RSP				= 59,
+	HPT_LOG_READ_CMD				= 60,			// read pending log text
+	HPT_LOG_READ_RSP				= 61,
+	HPT_BENCH_SWAP_CMD				= 62,			// time byte-swap options on a detector read
+	HPT_BENCH_SWAP_RSP				= 63,
+	HPT_BENCH_OSPI_CMD				= 64,			// time HAL and register-level word access
+	HPT_BENCH_OSPI_RSP				= 65,
+	HPT_ERASE_SECTORS_CMD			= 66,			// erase a set of sectors
+	HPT_ERASE_SECTORS_RSP			= 67,
+
 	HPT_ANA_GET_CAL_COUNTS_CMD		= 80,			// analog: get calibration counts for all channels
 	HPT_ANA_GET_CAL_COUNTS_RSP		= 81,
 	HPT_ANA_SET_CAL_COUNTS_CMD		= 82,			// analog: set calibration counts for one channel
 	HPT_ANA_SET_CAL_COUNTS_RSP		= 83,
 	HPT_ANA_SET_ACTIVE_COUNTS_CMD	= 84,			// analog: set channel
 	HPT_ANA_SET_ACTIVE_COUNTS_RSP	= 85,
+	HPT_ANA_SET_SETTLE_CMD			= 86,			// analog: set settling time model for one channel
+	HPT_ANA_SET_SETTLE_RSP			= 87,
 
 	HPT_CMD_RSP_LENGTH				= 0xFF,			// defines 1 byte for this enum (IAR) TODO: Does this work in GCC?
 } HPT_CmdRespEnum;
@@ -93,6 +124,7 @@ typedef enum __attribute((__packed__))
 
 	HPT_FAILURE_CLASS_CMD     = 1,					// command failure
 	HPT_FAILURE_CLASS_ANALOG  = 2,					// analog failure
+	HPT_FAILURE_CLASS_DET     = 3,					// detector program/erase failure
 
 	HPT_FAILURE_CLASS_LENGTH = 0xFFFF 				// defines 2 bytes for this enum (IAR) TODO: Does this work in GCC?
 } HPT_FailureClass;
@@ -102,6 +134,7 @@ typedef enum __attribute((__packed__))
 	HPT_FAILURE_CMD_UNIMPLEMENTED = 1, 				// command not implemented
 	HPT_FAILURE_CMD_BUSY          = 2, 				// command already in progress
 	HPT_FAILURE_CMD_INVALID_PARAM = 3, 				// invalid parameter
+	HPT_FAILURE_CMD_CANCELLED     = 4, 				// command cancelled before it completed
 
 	HPT_FAILURE_CMD_LENGTH = 0xFFFF,				// defines 2 bytes for this enum (IAR) TODO: Does this work in GCC?
 } HPT_FailureClassCmd;
@@ -113,6 +146,14 @@ typedef enum __attribute((__packed__))
 	HPT_FAILURE_ANA_LENGTH = 0xFFFF,				// defines 2 bytes for this enum (IAR) TODO: Does this work in GCC?
 } HPT_FailureClassAnalog;
 
+typedef enum __attribute((__packed__))
+{
+	HPT_FAILURE_DET_TIMEOUT = 1,					// operation did not complete in the CFI maximum time
+	HPT_FAILURE_DET_FAILED  = 2,					// device reported failure (DQ5)
+
+	HPT_FAILURE_DET_LENGTH = 0xFFFF,				// defines 2 bytes for this enum (IAR) TODO: Does this work in GCC?
+} HPT_FailureClassDet;
+
 typedef __PACKED_STRUCT __ALIGNED(4)
 {
 	uint16_t		Class;   // Class of failure
@@ -122,7 +163,10 @@ typedef __PACKED_STRUCT __ALIGNED(4)
 #define HPT_FAILURE_CODE_CMD_UNIMPLEMENTED (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_CMD, .Failure = HPT_FAILURE_CMD_UNIMPLEMENTED}
 #define HPT_FAILURE_CODE_CMD_BUSY          (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_CMD, .Failure = HPT_FAILURE_CMD_BUSY}
 #define HPT_FAILURE_CODE_CMD_INVALID_PARAM (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_CMD, .Failure = HPT_FAILURE_CMD_INVALID_PARAM}
+#define HPT_FAILURE_CODE_CMD_CANCELLED     (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_CMD, .Failure = HPT_FAILURE_CMD_CANCELLED}
 #define HPT_FAILURE_CODE_ANA_DAC_ERR       (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_ANALOG, .Failure = HPT_FAILURE_ANA_DAC_ERR}
+#define HPT_FAILURE_CODE_DET_TIMEOUT       (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_DET, .Failure = HPT_FAILURE_DET_TIMEOUT}
+#define HPT_FAILURE_CODE_DET_FAILED        (HPT_FailureCode){.Class = HPT_FAILURE_CLASS_DET, .Failure = HPT_FAILURE_DET_FAILED}
 
 /////////////////////  COMMANDS  ////////////////////////
 
@@ -166,13 +210,13 @@ typedef __PACKED_STRUCT __ALIGNED(4)
 {
 	uint32_t		SectorAddress;
 	uint16_t		ProgramValue;
-	uint16_t		_Pad[1];
+	uint16_t		Accelerated;			// 1 = raise WP#/ACC from CFI if supported (was padding)
 } HPT_ProgramSectorCmd;
 
 typedef __PACKED_STRUCT __ALIGNED(4)
 {
 	uint16_t		ProgramValue;
-	uint16_t		_Pad[1];
+	uint16_t		Accelerated;			// 1 = raise WP#/ACC from CFI if supported (was padding)
 } HPT_ProgramChipCmd;
 
 typedef __PACKED_STRUCT __ALIGNED(4)
@@ -194,6 +238,13 @@ typedef __PACKED_STRUCT __ALIGNED(4)
 	uint16_t		Data[2048];
 } HPT_ReadDataRsp;
 
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		NumWords;				// how many words were read and encoded, starting at BaseAddress
+	uint32_t		EncodedWords;			// how many words of Data are used
+	uint16_t		Data[(HPT_MAX_RSP_PAYLOAD - 8)/2];	// run-length encoded words, see rle.h
+} HPT_ReadDataRleRsp;
+
 typedef __PACKED_STRUCT __ALIGNED(4)
 {
 	uint16_t		Data[512];
@@ -206,6 +257,79 @@ typedef __PACKED_STRUCT __ALIGNED(4)
 	uint32_t		BitSet;					// how many bits read as 1 in the sector
 } HPT_GetSectorBitCountRsp;
 
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		SectorAddress;			// start of region
+	uint32_t		StartMv;				// first read voltage in mV
+	uint32_t		StopMv;					// last read voltage in mV (inclusive)
+	uint32_t		StepMv;					// voltage step in mV
+	uint32_t		NumWords;				// region size in words, up to one sector
+} HPT_VtSweepCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		NumPoints;				// number of voltages swept
+	uint32_t		BitCount[1024];			// bits read as 1 at StartMv + i*StepMv (cumulative Vt distribution)
+} HPT_VtSweepRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		BaseAddress;
+	uint32_t		NumWords;				// how many words to map, up to 256
+	uint32_t		StartMv;				// read voltage of code 0 in mV
+	uint32_t		StepMv;					// read voltage step per code in mV
+	uint32_t		MaxReads;				// most region reads to spend, 0 for no limit (up to 255)
+} HPT_VtMapCmd;
+
+// Bisection level L needs one region read per distinct midpoint, at most
+// min(2^L, cells): 8 reads when the Vts cluster, up to 255 when they spread
+// over every code. MaxReads stops before a level that would exceed it.
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		NumWords;				// how many words were mapped
+	uint32_t		Reads;					// how many region reads were needed
+	uint32_t		Levels;					// bisection levels done; below 8, each code is within 256 >> Levels above VtCode
+	uint8_t			VtCode[4096];			// per cell (word*16 + bit): first code reading 1, 255 if none
+} HPT_VtMapRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		BaseAddress;
+	uint32_t		NumWords;				// how many words to check, up to one sector
+	uint32_t		VtMode;					// true = read in Vt mode, else read normally
+	uint32_t		BitReadMv;				// if VtMode, read voltage in mV
+	uint32_t		Pattern;				// 0 = ExpectedValue, 1 = low 16 address bits, 2 = ExpectedValue at even / ~ExpectedValue at odd addresses
+	uint32_t		ExpectedValue;
+} HPT_FindFlipsCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		Address;				// word address
+	uint16_t		XorMask;				// bits which differ from the expected word
+	uint16_t		_Pad[1];
+} HPT_FlipEntry;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		TotalWords;				// how many words differ in the range
+	uint32_t		TotalBits;				// how many bits differ in the range
+	uint32_t		NumEntries;				// how many entries follow (first 512 differing words)
+	HPT_FlipEntry	Entries[512];
+} HPT_FindFlipsRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		FirstSector;			// sector index, not address
+	uint32_t		NumSectors;				// 0 = through the last sector
+} HPT_FingerprintChipCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		FirstSector;
+	uint32_t		NumSectors;
+	uint32_t		Crc[1024];				// CRC of each sector's words read normally
+} HPT_FingerprintChipRsp;
+
 typedef __PACKED_STRUCT __ALIGNED(4)
 {
 	uint32_t		VtMode;					// true = read in Vt mode, else read normally
@@ -297,6 +421,125 @@ typedef __PACKED_STRUCT __ALIGNED(4)
 	uint32_t		UnitCounts;
 } HPT_AnaSetActiveCountsCmd;
 
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		AnalogUnit; // 1=RESET 2=WP/ACC
+	float			SettleC0;	// us; with SettleC1 0 = default
+	float			SettleC1;	// us per mV of step
+} HPT_AnaSetSettleCmd;
+
+typedef enum
+{
+	HPT_JOB_STATE_UNKNOWN   = 0,					// no such job, or too old
+	HPT_JOB_STATE_QUEUED    = 1,
+	HPT_JOB_STATE_RUNNING   = 2,
+	HPT_JOB_STATE_DONE      = 3,
+	HPT_JOB_STATE_FAILED    = 4,					// finished with a failure response
+	HPT_JOB_STATE_CANCELLED = 5,
+} HPT_JobState;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		JobId;
+} HPT_JobSubmitRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		JobId;					// 0 = running or most recent job
+} HPT_JobCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		JobId;
+	uint32_t		Cmd;					// command ID of the job
+	uint32_t		State;					// HPT_JobState
+	uint32_t		Progress;				// steps done, e.g. sectors
+	uint32_t		Total;					// steps in job, 0 if unknown
+	uint32_t		QueuedMs;				// time from submit to start (so far, if still queued)
+	uint32_t		RunMs;					// time from start to end (so far, if still running)
+	HPT_FailureCode	Failure;				// first failure, if failed
+} HPT_JobStatusRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		Reset;					// true = clear counters after reading
+} HPT_DiagIsrCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		Calls;					// USB interrupts since reset
+	uint32_t		MaxCycles;				// longest USB interrupt in CPU cycles
+	uint32_t		TotalCyclesLo;			// total time in USB interrupt in CPU cycles, low word
+	uint32_t		TotalCyclesHi;			// high word
+	uint32_t		CoreClockHz;			// CPU clock, to convert cycles to time
+} HPT_DiagIsrRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		Lost;					// records overwritten before they could be read, since the last read
+	uint32_t		NumBytes;				// bytes of text; 0 if the log is empty
+	char			Text[HPT_MAX_RSP_PAYLOAD - 2*sizeof(uint32_t)];	// whole lines, "[tick] L message\n", not NUL-terminated
+} HPT_LogReadRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		BaseAddress;
+	uint32_t		NumWords;				// capped at 2048
+} HPT_BenchSwapCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		NumWords;				// words timed
+	uint32_t		ScalarCycles;			// swap only, one half-word at a time
+	uint32_t		Rev16Cycles;			// swap only, REV16
+	uint32_t		ReadMdmaCycles;			// read, swapped by MDMA during the transfer
+	uint32_t		ReadRev16Cycles;		// read, then REV16
+	uint32_t		ReadScalarCycles;		// read, then scalar swap
+	uint32_t		CoreClockHz;			// CPU clock, to convert cycles to time
+} HPT_BenchSwapRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		BaseAddress;
+	uint32_t		NumWords;				// capped at 2048
+} HPT_BenchOspiCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		NumWords;				// words timed
+	uint32_t		ReadHalCycles;			// NumWords single-word reads through the HAL
+	uint32_t		ReadFastCycles;			// NumWords single-word reads at register level
+	uint32_t		WriteHalCycles;			// NumWords single-word writes through the HAL
+	uint32_t		WriteFastCycles;		// NumWords single-word writes at register level
+	uint32_t		Mismatches;				// words read differently by the two paths; should be 0
+	uint32_t		CoreClockHz;			// CPU clock, to convert cycles to time
+} HPT_BenchOspiRsp;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		Sectors[32];			// bit (i % 32) of word i / 32 set = erase sector i
+} HPT_EraseSectorsCmd;
+
+/**
+ * Batch sub-commands and sub-responses are HPT messages without a CRC:
+ * 4-byte header (Length = header + payload) followed by the payload,
+ * padded to a multiple of 4 bytes.
+ */
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint32_t		NumCmds;				// how many sub-commands are in Cmds
+	uint32_t		StopOnFailure;			// true = stop after the first failed sub-command
+	uint8_t			Cmds[HPT_MAX_CMD_PAYLOAD - 8];
+} HPT_BatchCmd;
+
+typedef __PACKED_STRUCT __ALIGNED(4)
+{
+	uint16_t		FirstIndex;				// index of the first sub-command answered in this response
+	uint16_t		NumRsps;				// how many sub-responses are in Rsps
+	uint32_t		Last;					// true = last response for this batch, else more follow
+	uint8_t			Rsps[HPT_SIZE_OF_HEADER + HPT_MAX_RSP_PAYLOAD];	// room for at least one full sub-response
+} HPT_BatchRsp;
+
 /////////////////////  UNION OF ALL COMMANDS  ////////////////////////
 
 /**
@@ -322,10 +565,21 @@ typedef __PACKED_UNION __ALIGNED(4)
 			HPT_ProgramChipCmd			ProgramChipCmd;
 			HPT_GetSectorBitCountCmd	GetSectorBitCountCmd;
 			HPT_ReadDataCmd				ReadDataCmd;
+			HPT_ReadDataCmd				ReadDataRleCmd;
 			HPT_WriteDataCmd			WriteDataCmd;
 			HPT_ReadWordCmd				ReadWordCmd;
 			HPT_WriteCfgCmd				WriteCfgCmd;
 			HPT_ReadCfgCmd				ReadCfgCmd;
+			HPT_VtSweepCmd				VtSweepCmd;
+			HPT_VtMapCmd				VtMapCmd;
+			HPT_FindFlipsCmd			FindFlipsCmd;
+			HPT_FingerprintChipCmd		FingerprintChipCmd;
+			HPT_BatchCmd				BatchCmd;
+			HPT_JobCmd					JobCmd;
+			HPT_DiagIsrCmd				DiagIsrCmd;
+			HPT_BenchSwapCmd			BenchSwapCmd;
+			HPT_BenchOspiCmd			BenchOspiCmd;
+			HPT_EraseSectorsCmd			EraseSectorsCmd;
 			
 			HPT_CfgFlashReadCmd			CfgFlashReadCmd;
 			HPT_CfgFlashWriteCmd		CfgFlashWriteCmd;
@@ -334,6 +588,7 @@ typedef __PACKED_UNION __ALIGNED(4)
 			HPT_AnaGetCalCountsCmd		AnaGetCalCountsCmd;
 			HPT_AnaSetCalCountsCmd		AnaSetCalCountsCmd;
 			HPT_AnaSetActiveCountsCmd	AnaSetActiveCountsCmd;
+			HPT_AnaSetSettleCmd			AnaSetSettleCmd;
 
 			HPT_NoDataCmdRsp            NoDataCmdRsp;
 		};
@@ -362,8 +617,20 @@ typedef __PACKED_UNION __ALIGNED(4)
 			HPT_VtGetBitCountKPageRsp	VtGetBitCountKPageRsp;
 			HPT_GetSectorBitCountRsp	GetSectorBitCountRsp;
 			HPT_ReadDataRsp				ReadDataRsp;
+			HPT_ReadDataRleRsp			ReadDataRleRsp;
 			HPT_ReadWordRsp				ReadWordRsp;
 			HPT_ReadCfgRsp				ReadCfgRsp;
+			HPT_VtSweepRsp				VtSweepRsp;
+			HPT_VtMapRsp				VtMapRsp;
+			HPT_FindFlipsRsp			FindFlipsRsp;
+			HPT_FingerprintChipRsp		FingerprintChipRsp;
+			HPT_BatchRsp				BatchRsp;
+			HPT_JobSubmitRsp			JobSubmitRsp;
+			HPT_JobStatusRsp			JobStatusRsp;
+			HPT_DiagIsrRsp				DiagIsrRsp;
+			HPT_LogReadRsp				LogReadRsp;
+			HPT_BenchSwapRsp			BenchSwapRsp;
+			HPT_BenchOspiRsp			BenchOspiRsp;
 			HPT_CfgFlashReadRsp			CfgFlashReadRsp;
 			HPT_CfgFlashDevInfoRsp		CfgFlashDevInfoRsp;
 			HPT_AnaGetCalCountsRsp		AnaGetCalCountsRsp;
@@ -379,6 +646,10 @@ typedef __PACKED_UNION __ALIGNED(4)
 
 static_assert(sizeof(HPT_CmdRespEnum) == 1, "HPT_CmdRespEnum wrong size");
 static_assert(sizeof(HPT_FailureCode) == 4, "HPT_FailureCode wrong size");
+static_assert(sizeof(HPT_FlipEntry)   == 8, "HPT_FlipEntry wrong size");
+static_assert(sizeof(HPT_LogReadRsp)  <= HPT_MAX_RSP_PAYLOAD, "HPT_LogReadRsp does not fit in the response payload");
+static_assert(sizeof(HPT_MsgCmd) >= HPT_SIZE_OF_HEADER + sizeof(HPT_BatchCmd) + HPT_SIZE_OF_CRC, "HPT_BatchCmd does not fit in HPT_MsgCmd");
+static_assert(sizeof(HPT_MsgRsp) >= HPT_SIZE_OF_HEADER + sizeof(HPT_BatchRsp) + HPT_SIZE_OF_CRC, "HPT_BatchRsp does not fit in HPT_MsgRsp");
 static_assert(sizeof(HPT_MsgCmd)      == 64 + HPT_MAX_CMD_PAYLOAD, "HPT_MsgCmd wrong size :(");
 static_assert(sizeof(HPT_MsgRsp)      == 64 + HPT_MAX_RSP_PAYLOAD, "HPT_MsgRsp wrong size :(");
 
@@ -389,15 +660,27 @@ static_assert(offsetof(HPT_MsgCmd, ProgramSectorCmd)      == 4, "ProgramSectorCm
 static_assert(offsetof(HPT_MsgCmd, ProgramChipCmd)        == 4, "ProgramChipCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, GetSectorBitCountCmd)  == 4, "GetSectorBitCountCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, ReadDataCmd)           == 4, "ReadDataCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, ReadDataRleCmd)        == 4, "ReadDataRleCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, WriteDataCmd)          == 4, "WriteDataCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, ReadWordCmd)           == 4, "ReadWordCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, WriteCfgCmd)           == 4, "WriteCfgCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, ReadCfgCmd)            == 4, "ReadCfgCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, VtSweepCmd)            == 4, "VtSweepCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, VtMapCmd)              == 4, "VtMapCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, FindFlipsCmd)          == 4, "FindFlipsCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, FingerprintChipCmd)    == 4, "FingerprintChipCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, BatchCmd)              == 4, "BatchCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, JobCmd)                == 4, "JobCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, DiagIsrCmd)            == 4, "DiagIsrCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, BenchSwapCmd)          == 4, "BenchSwapCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, BenchOspiCmd)          == 4, "BenchOspiCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, EraseSectorsCmd)       == 4, "EraseSectorsCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, CfgFlashReadCmd)       == 4, "CfgFlashReadCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, CfgFlashWriteCmd)      == 4, "CfgFlashWriteCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, CfgFlashEraseCmd)      == 4, "CfgFlashEraseCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, AnaSetCalCountsCmd)    == 4, "AnaSetCalCountsCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, AnaSetActiveCountsCmd) == 4, "AnaSetActiveCountsCmd is not at offset 4");
+static_assert(offsetof(HPT_MsgCmd, AnaSetSettleCmd)       == 4, "AnaSetSettleCmd is not at offset 4");
 static_assert(offsetof(HPT_MsgCmd, NoDataCmdRsp)          == 4, "NoDataCmdRsp is not at offset 4");
 
 // responses must immediately follow header
@@ -406,8 +689,20 @@ static_assert(offsetof(HPT_MsgRsp, PingRsp)               == 4, "PingRsp is not
 static_assert(offsetof(HPT_MsgRsp, VtGetBitCountKPageRsp) == 4, "VtGetBitCountKPageRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, GetSectorBitCountRsp)  == 4, "GetSectorBitCountRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, ReadDataRsp)           == 4, "ReadDataRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, ReadDataRleRsp)        == 4, "ReadDataRleRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, ReadWordRsp)           == 4, "ReadWordRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, ReadCfgRsp)            == 4, "ReadCfgRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, VtSweepRsp)            == 4, "VtSweepRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, VtMapRsp)              == 4, "VtMapRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, FindFlipsRsp)          == 4, "FindFlipsRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, FingerprintChipRsp)    == 4, "FingerprintChipRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, BatchRsp)              == 4, "BatchRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, JobSubmitRsp)          == 4, "JobSubmitRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, JobStatusRsp)          == 4, "JobStatusRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, DiagIsrRsp)            == 4, "DiagIsrRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, LogReadRsp)            == 4, "LogReadRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, BenchSwapRsp)          == 4, "BenchSwapRsp is not at offset 4");
+static_assert(offsetof(HPT_MsgRsp, BenchOspiRsp)          == 4, "BenchOspiRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, CfgFlashReadRsp)       == 4, "CfgFlashReadRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, CfgFlashDevInfoRsp)    == 4, "CfgFlashDevInfoRsp is not at offset 4");
 static_assert(offsetof(HPT_MsgRsp, AnaGetCalCountsRsp)    == 4, "AnaGetCalCountsRsp is not at offset 4");
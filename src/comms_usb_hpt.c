@@ -10,279 +10,930 @@
 #include "det_ctrl.h"
 #include "analog.h"
 #include "qspi_flash_driver.h"
+#include "log.h"
 #include <stdbool.h>
 
-// debug
-#include <stdio.h>
-
 // TODO: Move this to a header
 extern uint32_t g_config_save_requested;
 
 extern CRC_HandleTypeDef hcrc;
 
 /**
- * @brief Global scratch response buffer
+ * @brief Responses sent from the USB interrupt
+ *
+ * Filled in order and released in order by comms_usb_hpt_tx_done once the IN
+ * endpoint has sent them, so a pipelined command cannot overwrite a reply still
+ * queued behind a main-loop response. While all are in flight, no further
+ * commands are parsed.
+ */
+#define COMMS_ISR_RSP_BUFS		4
+
+static HPT_MsgRsp m_isr_rsp[COMMS_ISR_RSP_BUFS] AXI_BSS;
+static uint32_t m_isr_rsp_head;		// next buffer to fill
+static uint32_t m_isr_rsp_count;	// buffers queued or being sent
+
+/**
+ * @brief Command slots
+ *
+ * Each slot is owned by exactly one of: the receiver (being filled), the free
+ * ring, the command queue, or the main loop (executing). Ownership passes by
+ * slot index, so queueing a received command does not copy it.
+ */
+#define COMMS_CMD_QUEUE_LEN		4							// commands waiting for the main loop
+#define COMMS_CMD_SLOTS			(COMMS_CMD_QUEUE_LEN + 2)	// + receiving + executing
+#define COMMS_CMD_RING_LEN		8							// power of 2, at least COMMS_CMD_SLOTS
+
+static HPT_MsgCmd m_cmd_slots[COMMS_CMD_SLOTS] AXI_BSS;
+
+/**
+ * @brief Single-producer single-consumer ring of slot indices
+ *
+ * Head is only written by the producer and Tail only by the consumer.
+ */
+typedef struct {
+	volatile uint32_t	Head;
+	volatile uint32_t	Tail;
+	uint8_t				Slot[COMMS_CMD_RING_LEN];
+} comms_cmd_ring;
+
+static comms_cmd_ring m_cmd_free;	// produced by main loop, consumed by USB interrupt
+static comms_cmd_ring m_cmd_queue;	// produced by USB interrupt, consumed by main loop
+
+/**
+ * @brief Slot the receiver is filling
+ */
+static HPT_MsgCmd *m_rx_cmd = &m_cmd_slots[0];
+
+/**
+ * @brief Jobs
  *
+ * Every queued command is a job. Jobs are kept in a ring, so the last
+ * COMMS_JOB_HISTORY jobs can be queried. It is longer than the queue, so
+ * a job is never reused before it finishes.
  */
-static HPT_MsgRsp g_msg_rsp;
+#define COMMS_JOB_HISTORY		8
+
+typedef struct {
+	volatile uint32_t	Id;			// 0 = unused
+	uint8_t				Cmd;
+	volatile uint8_t	State;		// HPT_JobState
+	volatile uint8_t	Cancel;		// cancel requested (set by USB interrupt)
+	volatile uint32_t	Progress;
+	volatile uint32_t	Total;
+	uint32_t			SubmitTick;
+	uint32_t			StartTick;
+	uint32_t			EndTick;
+	HPT_MsgRsp			Result;		// response, sent from here when the job completes
+} comms_job;
+
+static comms_job m_jobs[COMMS_JOB_HISTORY] AXI_BSS;
+static uint32_t m_job_next_id = 1;
+static uint8_t m_cmd_job[COMMS_CMD_SLOTS];		// job of each queued command slot
+static comms_job *volatile m_job_running;		// job being run by the main loop, or NULL
 
 /**
- * @brief Global current requested command
+ * @brief Scratch buffers for batch sub-commands
  */
-static HPT_MsgCmd g_msg_cmd;
+static HPT_MsgCmd m_batch_cmd AXI_BSS;
+static HPT_MsgRsp m_batch_rsp AXI_BSS;
+
+static inline uint32_t comms_cmd_ring_count(comms_cmd_ring *ring)
+{
+	return ring->Head - ring->Tail;
+}
 
-static HPT_MsgCmd m_cmd_copy; // copy for slow processing (outside of interrupt)
+static inline void comms_cmd_ring_push(comms_cmd_ring *ring, uint8_t slot)
+{
+	ring->Slot[ring->Head % COMMS_CMD_RING_LEN] = slot;
+	__DMB();
+	ring->Head++;
+}
+
+static inline uint8_t comms_cmd_ring_peek(comms_cmd_ring *ring)
+{
+	return ring->Slot[ring->Tail % COMMS_CMD_RING_LEN];
+}
+
+static inline void comms_cmd_ring_pop(comms_cmd_ring *ring)
+{
+	__DMB();
+	ring->Tail++;
+}
 
+/**
+ * @brief Reset the command queue
+ *
+ * @note Call before USB is started
+ */
 void comms_usb_hpt_reset(void)
 {
 	g_comms_cmd_req = HPT_NULL_MSG_CMD;
+
+	for (uint32_t i=0; i<COMMS_JOB_HISTORY; i++)
+		m_jobs[i].Id = 0;
+	m_job_running = NULL;
+	gDetAbort = 0;
+
+	m_cmd_queue.Head = m_cmd_queue.Tail = 0;
+	m_cmd_free.Head  = m_cmd_free.Tail  = 0;
+	m_rx_cmd = &m_cmd_slots[0];
+	for (uint8_t i=1; i<COMMS_CMD_SLOTS; i++)
+		comms_cmd_ring_push(&m_cmd_free, i);
+
+	comms_usb_hpt_tx_abort();
 }
 
 /**
- * @brief Handle kpage bit count with voltage request
- *
- * @note Runs in USB interrupt
+ * @brief Find a job by ID
  *
- * @param cmd Command
- * @param rsp Response
+ * @param id Job ID, or 0 for the running or most recent job
+ * @return comms_job* Job, or NULL if unknown or too old
  */
-void comms_hpt_handle_vt_get_bit_count_kpage_cmd(HPT_VtGetBitCountKPageCmd *cmd, HPT_MsgRsp *rsp)
+static comms_job *comms_job_find(uint32_t id)
 {
-	UNUSED(cmd);
-	rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
-	rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_UNIMPLEMENTED;
-	rsp->FailureRsp.Failures++;
+	if (id == 0) {
+		if (m_job_running)
+			return m_job_running;
+		id = m_job_next_id - 1;
+	}
+	if (id == 0)
+		return NULL;
+	comms_job *job = &m_jobs[(id - 1) % COMMS_JOB_HISTORY];
+	return job->Id == id ? job : NULL;
 }
 
 /**
- * @brief Handle sector bit count with voltage request
+ * @brief Report progress of the running job
  *
- * @note Runs in USB interrupt
+ * @note Runs in main loop
  *
- * @param cmd Command
- * @param rsp Response
+ * @param done  Steps done
+ * @param total Steps in job
  */
-void comms_hpt_handle_get_sector_bit_count_cmd(HPT_GetSectorBitCountCmd *cmd, HPT_MsgRsp *rsp)
+static void comms_job_progress(uint32_t done, uint32_t total)
 {
-	UNUSED(cmd);
-	rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
-	rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_UNIMPLEMENTED;
-	rsp->FailureRsp.Failures++;
+	comms_job *job = m_job_running;
+	if (job) {
+		job->Progress = done;
+		job->Total    = total;
+	}
 }
 
-static void read_data(uint32_t addr, uint16_t *data, uint32_t count)
+/**
+ * @brief Queue a command for the main loop as a new job
+ *
+ * If msg is the receive slot, the slot itself is queued and the receiver
+ * moves to a free slot. Otherwise msg is copied into a free slot.
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param msg Command
+ * @return uint32_t Job ID, or 0 if the queue is full
+ */
+static uint32_t comms_cmd_enqueue(HPT_MsgCmd *msg)
 {
-	// The last 512-word chunk of each sector may read garbage when ReadBlock is used.
-	// Use ReadWords for addresses in [0xFE00, 0x10000) and ReadBlock otherwise.
+	if (comms_cmd_ring_count(&m_cmd_free) == 0)
+		return 0;
+
+	uint8_t slot = comms_cmd_ring_peek(&m_cmd_free);
+	comms_cmd_ring_pop(&m_cmd_free);
 
-	uint32_t sector_offset = addr & 0xFFFF;
-	
-	if (sector_offset + count < 0xFE00) {
-		gDetApi->ReadBlock(addr, count, data);
+	uint32_t id = m_job_next_id++;
+	if (m_job_next_id == 0)
+		m_job_next_id = 1;
+	uint8_t index = (id - 1) % COMMS_JOB_HISTORY;
+	comms_job *job = &m_jobs[index];
+	job->Cmd        = msg->CmdRsp;
+	job->State      = HPT_JOB_STATE_QUEUED;
+	job->Cancel     = 0;
+	job->Progress   = 0;
+	job->Total      = 0;
+	job->SubmitTick = HAL_GetTick();
+	job->Id         = id;
+
+	if (msg == m_rx_cmd) {
+		uint8_t rx_slot = (uint8_t)(m_rx_cmd - m_cmd_slots);
+		m_cmd_job[rx_slot] = index;
+		comms_cmd_ring_push(&m_cmd_queue, rx_slot);
+		m_rx_cmd = &m_cmd_slots[slot];
 	} else {
-		// Block 0 is addr up to the last 512-word chunk of the sector
-		// Block 1 is the last 512-word chunk of the sector
-		// Block 2 is the remaining data in the next sector
-		// Block 0 and Block 2 may be empty. Block 1 may be partial.
-		uint32_t block0_addr  = addr;
-		int32_t  block0_count = sector_offset         < 0xFE00  ? 0xFE00  - sector_offset : 0; //MAX(0xFE00 - sector_offset, 0);
-		uint32_t block1_addr  = block0_addr + block0_count; // = sector + 0xFE00
-		int32_t  block1_count = sector_offset         > 0xFE00  ? 0x10000 - sector_offset : (
-		                        sector_offset + count < 0x10000 ? count   - block0_count  : 512); //MIN(count - block0_count, 512);	
-		uint32_t block2_addr  = block1_addr + block1_count; // = sector + 0x10000
-		int32_t  block2_count = count - block0_count - block1_count;
+		memcpy(&m_cmd_slots[slot], msg, sizeof(HPT_MsgCmd));
+		m_cmd_job[slot] = index;
+		comms_cmd_ring_push(&m_cmd_queue, slot);
+	}
+
+	// wake the main loop now rather than at the next housekeeping tick
+	gMainLoopSemaphore = 1;
+	__SEV();
+
+	return id;
+}
+
+/**
+ * @brief Whether the main loop has commands queued or executing
+ *
+ * @note Runs in USB interrupt
+ */
+static bool comms_cmd_busy(void)
+{
+	return comms_cmd_ring_count(&m_cmd_queue) != 0 || g_comms_cmd_req != HPT_NULL_MSG_CMD;
+}
 
-		if (block0_count > 0)
-			gDetApi->ReadBlock(block0_addr, block0_count, data);
-		for (int32_t i = 0; i < block1_count; i++)
-			data[block0_count + i] = gDetApi->ReadWord(block1_addr + i);
-		if (block2_count > 0)
-			gDetApi->ReadBlock(block2_addr, block2_count, data + block0_count + block1_count);
+/**
+ * @brief Whether a command is acknowledged when queued rather than answered when done
+ */
+static bool comms_cmd_is_acked(HPT_CmdRespEnum cmd)
+{
+	switch (cmd) {
+		case HPT_ERASE_CHIP_CMD:
+		case HPT_ERASE_SECTOR_CMD:
+		case HPT_ERASE_SECTORS_CMD:
+		case HPT_PROGRAM_SECTOR_CMD:
+		case HPT_PROGRAM_CHIP_CMD:
+		case HPT_WRITE_DATA_CMD:
+			return true;
+		default:
+			return false;
 	}
 }
 
 /**
- * @brief Handle data read with voltage request
+ * @brief Report a detector program/erase error as a failure
+ *
+ * @param rsp Response
+ * @param err Result of the operation
+ * @return bool Whether err was an error
+ */
+static bool comms_hpt_rsp_det_error(HPT_MsgRsp *rsp, DetError err)
+{
+	if (err == DET_OK)
+		return false;
+	rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+	rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] =
+		err == DET_ERR_TIMEOUT ? HPT_FAILURE_CODE_DET_TIMEOUT : HPT_FAILURE_CODE_DET_FAILED;
+	rsp->FailureRsp.Failures++;
+	return true;
+}
+
+/**
+ * @brief Handle ping
  *
  * @note Runs in USB interrupt
  *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_read_data_cmd(HPT_ReadDataCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_ping_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
 {
-	uint32_t isVt = cmd->VtMode;
-	uint32_t vtMv = cmd->BitReadMv;
-	uint32_t addr = cmd->BaseAddress;
+	UNUSED(cmd);
+	rsp->Length += sizeof(HPT_PingRsp);
+	rsp->CmdRsp = HPT_PING_RSP;
+	rsp->PingRsp.UptimeSeconds = HAL_GetTick() / 1000;
+	rsp->PingRsp.VersionString[0] = 'N';
+	rsp->PingRsp.VersionString[1] = 'R';
+	rsp->PingRsp.VersionString[2] = '1';
+	rsp->PingRsp.VersionString[3] = ' ';
+	rsp->PingRsp.VersionString[4] = 't';
+	rsp->PingRsp.VersionString[5] = 'e';
+	rsp->PingRsp.VersionString[6] = 's';
+	rsp->PingRsp.VersionString[7] = 't';
+	rsp->PingRsp.VersionString[8] = '\0';
+	for (uint32_t i=9; i<16; i++) rsp->PingRsp.VersionString[i] = 0;
+	rsp->PingRsp.IsDetectorBusy   = comms_cmd_busy();
+	rsp->PingRsp.ResetFlags       = gResetFlags;
+	rsp->PingRsp.Task             = g_comms_cmd_req;
+	rsp->PingRsp.TaskState        = g_comms_cmd_req_state;
+}
 
+/**
+ * @brief Handle kpage bit count with voltage request
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_vt_get_bit_count_kpage_cmd(HPT_VtGetBitCountKPageCmd *cmd, HPT_MsgRsp *rsp)
+{
 	int iserr = 0;
 
-	if (isVt) {
-		iserr |= DetEnterVtMode();
-		iserr |= DetSetVt(vtMv);
-	} else {
-		iserr |= DetExitVtMode();
-	}
-
-	// Cap at words in response buffer
-	uint32_t count_max = sizeof(rsp->ReadDataRsp.Data) / sizeof(uint16_t);
-	uint32_t count = cmd->NumWords > count_max ? count_max : cmd->NumWords;
-
-	// The last 512-word chunk of each sector may read garbage when ReadBlock is used.
-	// Use ReadWords for addresses in [0xFE00, 0x10000) and ReadBlock otherwise.
-	if (count > 0)
-		read_data(addr, rsp->ReadDataRsp.Data, count);
-
-	/*if (isVt)
-	{
-		iserr |= DetExitVtMode();
-	}*/
+	iserr |= DetEnterVtMode();
+	iserr |= DetSetVt(cmd->BitReadMv);
 
 	if (iserr) {
 		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
-		rsp->FailureRsp.FailureCodes[g_msg_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
 		rsp->FailureRsp.Failures++;
-	} else {
-		rsp->CmdRsp = HPT_READ_DATA_RSP;
-		rsp->Length += 2*(count + count % 2); // round up to nearest 4-byte boundary
+		return;
 	}
+
+	DetCmdCountBitsKPage(cmd->BaseAddress, rsp->VtGetBitCountKPageRsp.BitCount);
+
+	rsp->CmdRsp = HPT_VT_GET_BIT_COUNT_KPAGE_RSP;
+	rsp->Length += sizeof(HPT_VtGetBitCountKPageRsp);
 }
 
+// Serves queued reads during a sector erase; defined with the job runner
+static void comms_hpt_erase_idle(void);
+
 /**
- * @brief Handle read word with voltage request
+ * @brief Handle chip erase
  *
- * @note Runs in USB interrupt
+ * @note Runs in main loop
  *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_read_word_cmd(HPT_ReadWordCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_erase_chip_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
 {
-	uint32_t isVt    = cmd->VtMode;
-	uint32_t vtMv    = cmd->BitReadMv;
-	uint32_t addr    = cmd->WordAddress;
-	uint32_t samples = cmd->Samples > 0 ? cmd->Samples : 1;
-
-	// initialize sample array
-	for (uint32_t b=0; b<16; b++) rsp->ReadWordRsp.BitSample[b] = 0;
+	UNUSED(cmd);
+	DetReset();
+	g_comms_cmd_req_state = 3;
+	rsp->CmdRsp = HPT_ERASE_CHIP_RSP;
+	comms_hpt_rsp_det_error(rsp, DetCmdEraseChip());
+}
 
-	if (isVt) {
-		DetEnterVtMode();
-		DetSetVt(vtMv);
-	} else {
-		DetExitVtMode();
-	}
+/**
+ * @brief Handle sector erase
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_erase_sector_cmd(HPT_EraseSectorCmd *cmd, HPT_MsgRsp *rsp)
+{
+	DetReset();
+	g_comms_cmd_req_state = 3;
+	rsp->CmdRsp = HPT_ERASE_SECTOR_RSP;
+	comms_hpt_rsp_det_error(rsp, DetCmdEraseSector(cmd->SectorAddress, comms_hpt_erase_idle));
+}
 
-	for (uint32_t i=0; i<samples; i++) {
-		uint16_t word = gDetApi->ReadWord(addr);
-		for (uint32_t b=0; b<16; b++) {
-			rsp->ReadWordRsp.BitSample[b] += ((word >> b) & 0x1) ? 1 : 0;
+/**
+ * @brief Prepare the detector for a program command
+ *
+ * Raises WP#/ACC if accelerated programming is requested and supported
+ * (otherwise programs normally), then enters unlock bypass.
+ *
+ * @param rsp         Response, for failures
+ * @param accelerated Whether accelerated programming was requested
+ * @return bool Whether programming may go ahead; if not, the failure is in rsp
+ */
+static bool comms_hpt_program_begin(HPT_MsgRsp *rsp, bool accelerated)
+{
+	if (accelerated) {
+		int err = DetEnterAccMode();
+		if (err == 1) {
+			LOG_WARN("[comms_hpt_program_begin] ACC not supported, programming normally");
+		} else if (err) {
+			DetExitAccMode();
+			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+			rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+			rsp->FailureRsp.Failures++;
+			return false;
 		}
 	}
-
-	rsp->ReadWordRsp.Samples = samples;
-
-	/*if (isVt)
-	{
-		DetExitVtMode();
-	}*/
-
-	rsp->CmdRsp = HPT_READ_WORD_RSP;
-	rsp->Length += sizeof(HPT_ReadWordRsp);
+	gDetApi->UnlockBypassEnter();
+	return true;
 }
 
 /**
- * @brief Handle write config
- * 
- * @note Runs in USB interrupt
- * 
- * @param cmd Command
- * @param rsp Response
+ * @brief Undo comms_hpt_program_begin, whether or not programming succeeded
+ *
+ * @param rsp         Response, for failures
+ * @param accelerated Whether accelerated programming was requested
  */
-void comms_hpt_handle_write_cfg_cmd(HPT_WriteCfgCmd *cmd, HPT_MsgRsp *rsp)
+static void comms_hpt_program_end(HPT_MsgRsp *rsp, bool accelerated)
 {
-	uint32_t addr = cmd->Address | 0x80000000;
-	uint16_t word = (uint16_t)cmd->Data;
-	gDetApi->WriteCommandWord(addr, word);
-	rsp->CmdRsp = HPT_WRITE_CFG_RSP;
+	gDetApi->UnlockBypassExit();
+	if (accelerated && DetExitAccMode()) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+	}
 }
 
 /**
- * @brief Handle read config
- * 
- * @note Runs in USB interrupt
- * 
+ * @brief Handle multi-sector erase
+ *
+ * Erases the selected sectors in batches, each batch as one erase operation.
+ *
+ * @note Runs in main loop
+ *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_read_cfg_cmd(HPT_ReadCfgCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_erase_sectors_cmd(HPT_EraseSectorsCmd *cmd, HPT_MsgRsp *rsp)
 {
-	uint32_t addr = cmd->Address | 0x80000000;
-	rsp->ReadCfgRsp.Data = gDetApi->ReadWord(addr);
-	rsp->CmdRsp = HPT_READ_CFG_RSP;
-	rsp->Length += sizeof(HPT_ReadCfgRsp);
+	DetReset();
+	g_comms_cmd_req_state = 3;
+	rsp->CmdRsp = HPT_ERASE_SECTORS_RSP;
+	for (uint32_t next = 0; next < 1024 && !gDetAbort; ) {
+		g_comms_cmd_req_state = 4 + next;
+		comms_job_progress(next, 1024);
+		if (comms_hpt_rsp_det_error(rsp, DetCmdEraseSectors(cmd->Sectors, &next, comms_hpt_erase_idle)))
+			break;
+	}
 }
 
 /**
- * @brief Handle config flash enter
- * 
- * @note Runs in USB interrupt
- * 
+ * @brief Handle sector program
+ *
+ * @note Runs in main loop
+ *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_cfg_flash_enter_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_program_sector_cmd(HPT_ProgramSectorCmd *cmd, HPT_MsgRsp *rsp)
 {
-	UNUSED(cmd);
-	gDetApi->EnterCfgFlash();
-	rsp->CmdRsp = HPT_CFG_FLASH_ENTER_RSP;
+	DetReset();
+	g_comms_cmd_req_state = 3;
+	rsp->CmdRsp = HPT_PROGRAM_SECTOR_RSP;
+	if (!comms_hpt_program_begin(rsp, cmd->Accelerated))
+		return;
+	comms_hpt_rsp_det_error(rsp, DetCmdProgramSector(cmd->SectorAddress, cmd->ProgramValue));
+	comms_hpt_program_end(rsp, cmd->Accelerated);
 }
 
 /**
- * @brief Handle config flash exit
- * 
- * @note Runs in USB interrupt
- * 
+ * @brief Handle chip program
+ *
+ * @note Runs in main loop
+ *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_cfg_flash_exit_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_program_chip_cmd(HPT_ProgramChipCmd *cmd, HPT_MsgRsp *rsp)
 {
-	UNUSED(cmd);
-	gDetApi->ExitCfgFlash();
-	rsp->CmdRsp = HPT_CFG_FLASH_EXIT_RSP;
+	DetReset();
+	g_comms_cmd_req_state = 3;
+	rsp->CmdRsp = HPT_PROGRAM_CHIP_RSP;
+	if (!comms_hpt_program_begin(rsp, cmd->Accelerated))
+		return;
+	for (uint32_t i=0; i<1024 && !gDetAbort; i++) {
+		g_comms_cmd_req_state = 4 + i;
+		comms_job_progress(i, 1024);
+		if (comms_hpt_rsp_det_error(rsp, DetCmdProgramSector(i * 0x10000, cmd->ProgramValue))) {
+			LOG_ERROR("[comms_hpt_handle_program_chip_cmd] Sector %lu failed", i);
+			break;
+		}
+	}
+	comms_hpt_program_end(rsp, cmd->Accelerated);
 }
 
 /**
- * @brief Handle config flash read
- * 
- * @note Runs in USB interrupt
- * 
+ * @brief Handle data write
+ *
+ * @note Runs in main loop
+ *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_cfg_flash_read_cmd(HPT_CfgFlashReadCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_write_data_cmd(HPT_WriteDataCmd *cmd, HPT_MsgRsp *rsp)
 {
-	QSPI_Flash_ReleasePowerDown();
-	QSPI_Flash_ReadBlock(cmd->Address, cmd->NumBytes, rsp->CfgFlashReadRsp.Data);
-	QSPI_Flash_PowerDown();
-	rsp->CmdRsp = HPT_CFG_FLASH_READ_RSP;
-	rsp->Length += cmd->NumBytes * sizeof(uint8_t);
+	rsp->CmdRsp = HPT_WRITE_DATA_RSP;
+	gDetApi->UnlockBypassEnter();
+	comms_hpt_rsp_det_error(rsp, gDetApi->ProgramBuffer(cmd->BaseAddress, cmd->Data, cmd->NumWords));
+	gDetApi->UnlockBypassExit();
 }
 
 /**
- * @brief Handle config flash write
- * 
- * @note Runs in USB interrupt
- * 
+ * @brief Handle sector bit count with voltage request
+ *
+ * @note Runs in main loop
+ *
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_cfg_flash_write_cmd(HPT_CfgFlashWriteCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_get_sector_bit_count_cmd(HPT_GetSectorBitCountCmd *cmd, HPT_MsgRsp *rsp)
 {
-	QSPI_Flash_ReleasePowerDown();
-	uint32_t remaining = cmd->NumWords;
-	uint32_t address = cmd->BaseAddress;
+	int iserr = 0;
+
+	iserr |= DetEnterVtMode();
+	iserr |= DetSetVt(cmd->BitReadMv);
+
+	if (iserr) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	rsp->GetSectorBitCountRsp.BitSet = DetCmdCountBitsSector(cmd->BaseAddress);
+
+	rsp->CmdRsp = HPT_GET_SECTOR_BIT_COUNT_RSP;
+	rsp->Length += sizeof(HPT_GetSectorBitCountRsp);
+}
+
+/**
+ * @brief Handle Vt sweep request
+ *
+ * Counts the 1 bits in a region at each voltage from StartMv to StopMv,
+ * giving the cumulative Vt distribution of the region.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_vt_sweep_cmd(HPT_VtSweepCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint32_t points_max = sizeof(rsp->VtSweepRsp.BitCount) / sizeof(uint32_t);
+
+	if (cmd->StepMv == 0 || cmd->StopMv < cmd->StartMv || cmd->NumWords == 0 || cmd->NumWords > 0x10000 ||
+	    (cmd->StopMv - cmd->StartMv) / cmd->StepMv >= points_max) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	uint32_t points = (cmd->StopMv - cmd->StartMv) / cmd->StepMv + 1;
+
+	if (DetCmdVtSweep(cmd->SectorAddress, cmd->NumWords, cmd->StartMv, cmd->StepMv, points, rsp->VtSweepRsp.BitCount)) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	rsp->VtSweepRsp.NumPoints = points;
+	rsp->CmdRsp = HPT_VT_SWEEP_RSP;
+	rsp->Length += sizeof(rsp->VtSweepRsp.NumPoints) + points * sizeof(uint32_t);
+}
+
+/**
+ * @brief Handle Vt map request
+ *
+ * Finds the Vt code of each cell in a word range by bisection, within
+ * the command's read budget.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_vt_map_cmd(HPT_VtMapCmd *cmd, HPT_MsgRsp *rsp)
+{
+	if (cmd->NumWords == 0 || cmd->NumWords > DET_VT_MAP_MAX_WORDS || cmd->StepMv == 0) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	uint32_t reads = 0;
+	uint32_t levels = 0;
+	if (DetCmdVtMap(cmd->BaseAddress, cmd->NumWords, cmd->StartMv, cmd->StepMv, cmd->MaxReads,
+	                rsp->VtMapRsp.VtCode, &reads, &levels)) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	rsp->VtMapRsp.NumWords = cmd->NumWords;
+	rsp->VtMapRsp.Reads = reads;
+	rsp->VtMapRsp.Levels = levels;
+	rsp->CmdRsp = HPT_VT_MAP_RSP;
+	rsp->Length += offsetof(HPT_VtMapRsp, VtCode) + 16*cmd->NumWords;
+}
+
+/**
+ * @brief Handle bit flip search request
+ *
+ * Reads a word range and returns only the words which differ from the expected pattern.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_find_flips_cmd(HPT_FindFlipsCmd *cmd, HPT_MsgRsp *rsp)
+{
+	// Entries are filled in place as DetFlip, then _Pad is cleared: the layouts must match
+	static_assert(sizeof(DetFlip) == sizeof(HPT_FlipEntry), "DetFlip does not match HPT_FlipEntry");
+	static_assert(offsetof(DetFlip, Address) == offsetof(HPT_FlipEntry, Address)
+	              && sizeof(((DetFlip *)0)->Address) == sizeof(((HPT_FlipEntry *)0)->Address),
+	              "DetFlip.Address does not match HPT_FlipEntry");
+	static_assert(offsetof(DetFlip, XorMask) == offsetof(HPT_FlipEntry, XorMask)
+	              && sizeof(((DetFlip *)0)->XorMask) == sizeof(((HPT_FlipEntry *)0)->XorMask),
+	              "DetFlip.XorMask does not match HPT_FlipEntry");
+	static_assert(offsetof(HPT_FlipEntry, _Pad) == offsetof(DetFlip, XorMask) + sizeof(((DetFlip *)0)->XorMask)
+	              && offsetof(HPT_FlipEntry, _Pad) + sizeof(((HPT_FlipEntry *)0)->_Pad) == sizeof(DetFlip),
+	              "HPT_FlipEntry._Pad is not DetFlip's tail padding");
+
+	if (cmd->NumWords > 0x10000 || cmd->Pattern > DET_PATTERN_CHECKERBOARD) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	int iserr = 0;
+	if (cmd->VtMode) {
+		iserr |= DetEnterVtMode();
+		iserr |= DetSetVt(cmd->BitReadMv);
+	} else {
+		iserr |= DetExitVtMode();
+	}
+
+	if (iserr) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	uint32_t max_entries = sizeof(rsp->FindFlipsRsp.Entries) / sizeof(HPT_FlipEntry);
+	uint32_t words = 0, bits = 0;
+	DetCmdFindFlips(cmd->BaseAddress, cmd->NumWords, (det_pattern)cmd->Pattern, (uint16_t)cmd->ExpectedValue,
+	                (DetFlip *)rsp->FindFlipsRsp.Entries, max_entries, &words, &bits);
+
+	uint32_t entries = words < max_entries ? words : max_entries;
+	for (uint32_t i=0; i<entries; i++)
+		rsp->FindFlipsRsp.Entries[i]._Pad[0] = 0;
+
+	rsp->FindFlipsRsp.TotalWords = words;
+	rsp->FindFlipsRsp.TotalBits  = bits;
+	rsp->FindFlipsRsp.NumEntries = entries;
+	rsp->CmdRsp = HPT_FIND_FLIPS_RSP;
+	rsp->Length += 3*sizeof(uint32_t) + entries*sizeof(HPT_FlipEntry);
+}
+
+/**
+ * @brief Handle chip fingerprint request
+ *
+ * Returns one CRC per sector. The host compares these with a previous scan
+ * and reads back only the sectors which changed.
+ *
+ * @note Runs in main loop. The USB interrupt is only masked while the CRC
+ * peripheral holds a partial result, so pings and short commands are still
+ * answered. Progress is reported in the ping task state (4 + sectors done).
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_fingerprint_chip_cmd(HPT_FingerprintChipCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint32_t first = cmd->FirstSector;
+	uint32_t count = cmd->NumSectors ? cmd->NumSectors : 1024 - first;
+
+	if (first >= 1024 || count > 1024 - first) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	if (DetExitVtMode()) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	for (uint32_t i=0; i<count && !gDetAbort; i++) {
+		g_comms_cmd_req_state = 4 + i;
+		comms_job_progress(i, count);
+		rsp->FingerprintChipRsp.Crc[i] = DetCmdCrcRange((first + i) * 0x10000, 0x10000);
+	}
+
+	rsp->FingerprintChipRsp.FirstSector = first;
+	rsp->FingerprintChipRsp.NumSectors  = count;
+	rsp->CmdRsp = HPT_FINGERPRINT_CHIP_RSP;
+	rsp->Length += 2*sizeof(uint32_t) + count*sizeof(uint32_t);
+}
+
+/**
+ * @brief Handle data read with voltage request
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_read_data_cmd(HPT_ReadDataCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint32_t isVt = cmd->VtMode;
+	uint32_t vtMv = cmd->BitReadMv;
+	uint32_t addr = cmd->BaseAddress;
+
+	int iserr = 0;
+
+	if (isVt) {
+		iserr |= DetEnterVtMode();
+		iserr |= DetSetVt(vtMv);
+	} else {
+		iserr |= DetExitVtMode();
+	}
+
+	// Cap at words in response buffer
+	uint32_t count_max = sizeof(rsp->ReadDataRsp.Data) / sizeof(uint16_t);
+	uint32_t count = cmd->NumWords > count_max ? count_max : cmd->NumWords;
+
+	// DetReadData works around the last 512-word chunk of each sector
+	if (count > 0)
+		DetReadData(addr, rsp->ReadDataRsp.Data, count);
+
+	/*if (isVt)
+	{
+		iserr |= DetExitVtMode();
+	}*/
+
+	if (iserr) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+	} else {
+		rsp->CmdRsp = HPT_READ_DATA_RSP;
+		rsp->Length += 2*(count + count % 2); // round up to nearest 4-byte boundary
+	}
+}
+
+/**
+ * @brief Handle run-length encoded data read request
+ *
+ * Reads from BaseAddress until NumWords words are read or the response is
+ * full. NumWords in the response tells the host where to continue.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_read_data_rle_cmd(HPT_ReadDataCmd *cmd, HPT_MsgRsp *rsp)
+{
+	if (cmd->NumWords > 0x10000) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	int iserr = 0;
+	if (cmd->VtMode) {
+		iserr |= DetEnterVtMode();
+		iserr |= DetSetVt(cmd->BitReadMv);
+	} else {
+		iserr |= DetExitVtMode();
+	}
+
+	if (iserr) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_ANA_DAC_ERR;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	RleEncoder enc;
+	RleEncoderInit(&enc, rsp->ReadDataRleRsp.Data, sizeof(rsp->ReadDataRleRsp.Data) / sizeof(uint16_t));
+	uint32_t count = DetCmdReadRle(cmd->BaseAddress, cmd->NumWords, &enc);
+
+	if (enc.Len % 2)
+		rsp->ReadDataRleRsp.Data[enc.Len] = 0;
+
+	rsp->ReadDataRleRsp.NumWords     = count;
+	rsp->ReadDataRleRsp.EncodedWords = enc.Len;
+	rsp->CmdRsp = HPT_READ_DATA_RLE_RSP;
+	rsp->Length += 2*sizeof(uint32_t) + 2*(enc.Len + enc.Len % 2); // round up to nearest 4-byte boundary
+}
+
+/**
+ * @brief Handle read word with voltage request
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_read_word_cmd(HPT_ReadWordCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint32_t isVt    = cmd->VtMode;
+	uint32_t vtMv    = cmd->BitReadMv;
+	uint32_t addr    = cmd->WordAddress;
+	uint32_t samples = cmd->Samples > 0 ? cmd->Samples : 1;
+
+	// initialize sample array
+	for (uint32_t b=0; b<16; b++) rsp->ReadWordRsp.BitSample[b] = 0;
+
+	if (isVt) {
+		DetEnterVtMode();
+		DetSetVt(vtMv);
+	} else {
+		DetExitVtMode();
+	}
+
+	for (uint32_t i=0; i<samples; i++) {
+		uint16_t word = gDetApi->ReadWord(addr);
+		for (uint32_t b=0; b<16; b++) {
+			rsp->ReadWordRsp.BitSample[b] += ((word >> b) & 0x1) ? 1 : 0;
+		}
+	}
+
+	rsp->ReadWordRsp.Samples = samples;
+
+	/*if (isVt)
+	{
+		DetExitVtMode();
+	}*/
+
+	rsp->CmdRsp = HPT_READ_WORD_RSP;
+	rsp->Length += sizeof(HPT_ReadWordRsp);
+}
+
+/**
+ * @brief Handle write config
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_write_cfg_cmd(HPT_WriteCfgCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint32_t addr = cmd->Address | 0x80000000;
+	uint16_t word = (uint16_t)cmd->Data;
+	gDetApi->WriteCommandWord(addr, word);
+	rsp->CmdRsp = HPT_WRITE_CFG_RSP;
+}
+
+/**
+ * @brief Handle read config
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_read_cfg_cmd(HPT_ReadCfgCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint32_t addr = cmd->Address | 0x80000000;
+	rsp->ReadCfgRsp.Data = gDetApi->ReadWord(addr);
+	rsp->CmdRsp = HPT_READ_CFG_RSP;
+	rsp->Length += sizeof(HPT_ReadCfgRsp);
+}
+
+/**
+ * @brief Handle config flash enter
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_cfg_flash_enter_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+{
+	UNUSED(cmd);
+	gDetApi->EnterCfgFlash();
+	rsp->CmdRsp = HPT_CFG_FLASH_ENTER_RSP;
+}
+
+/**
+ * @brief Handle config flash exit
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_cfg_flash_exit_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+{
+	UNUSED(cmd);
+	gDetApi->ExitCfgFlash();
+	rsp->CmdRsp = HPT_CFG_FLASH_EXIT_RSP;
+}
+
+/**
+ * @brief Handle config flash read
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_cfg_flash_read_cmd(HPT_CfgFlashReadCmd *cmd, HPT_MsgRsp *rsp)
+{
+	QSPI_Flash_ReleasePowerDown();
+	QSPI_Flash_ReadBlock(cmd->Address, cmd->NumBytes, rsp->CfgFlashReadRsp.Data);
+	QSPI_Flash_PowerDown();
+	rsp->CmdRsp = HPT_CFG_FLASH_READ_RSP;
+	rsp->Length += cmd->NumBytes * sizeof(uint8_t);
+}
+
+/**
+ * @brief Handle config flash write
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_cfg_flash_write_cmd(HPT_CfgFlashWriteCmd *cmd, HPT_MsgRsp *rsp)
+{
+	QSPI_Flash_ReleasePowerDown();
+	uint32_t remaining = cmd->NumWords;
+	uint32_t address = cmd->BaseAddress;
 	uint8_t *data = cmd->Data;
 	while (remaining > 0) {
 		uint32_t count = remaining > 256 ? 256 : remaining;
@@ -295,134 +946,715 @@ void comms_hpt_handle_cfg_flash_write_cmd(HPT_CfgFlashWriteCmd *cmd, HPT_MsgRsp
 		uint8_t sr1 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_1);
 		while (sr1 & 0x01) sr1 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_1);
 	}
-	//QSPI_Flash_ProgramBuffer(cmd->BaseAddress, cmd->Data, cmd->NumWords);
+	//QSPI_Flash_ProgramBuffer(cmd->BaseAddress, cmd->Data, cmd->NumWords);
+	QSPI_Flash_PowerDown();
+	rsp->CmdRsp = HPT_CFG_FLASH_WRITE_RSP;
+}
+
+/**
+ * @brief Handle config flash erase
+ * 
+ * @note Runs in main loop
+ * 
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_cfg_flash_erase_cmd(HPT_CfgFlashEraseCmd *cmd, HPT_MsgRsp *rsp)
+{
+	QSPI_Flash_ReleasePowerDown();
+	rsp->CmdRsp = HPT_CFG_FLASH_ERASE_RSP;
+	switch (cmd->EraseType) {
+		case 0: QSPI_Flash_EraseSector(cmd->Address); break;
+		case 1: QSPI_Flash_EraseBlock32(cmd->Address); break;
+		case 2: QSPI_Flash_EraseBlock64(cmd->Address); break;
+		case 3: QSPI_Flash_EraseChip(); break;
+		default:
+			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+			rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+			rsp->FailureRsp.Failures++;
+			break;
+	}
 	QSPI_Flash_PowerDown();
-	rsp->CmdRsp = HPT_CFG_FLASH_WRITE_RSP;
 }
 
 /**
- * @brief Handle config flash erase
+ * @brief Handle config flash get device info
  * 
- * @note Runs in USB interrupt
+ * @note Runs in main loop
  * 
  * @param cmd Command
  * @param rsp Response
  */
-void comms_hpt_handle_cfg_flash_erase_cmd(HPT_CfgFlashEraseCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_cfg_flash_dev_info_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+{
+	UNUSED(cmd);
+	uint8_t mf, id, jedec_type, jedec_cap;
+	uint8_t sr1, sr2, sr3;
+
+	QSPI_Flash_ReleasePowerDown();
+	QSPI_Flash_ReadMfgDevID(&mf, &id);
+	QSPI_Flash_ReadJEDECID(&mf, &jedec_type, &jedec_cap);
+	QSPI_Flash_ReadUniqueID(rsp->CfgFlashDevInfoRsp.UniqueID);
+	sr1 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_1);
+	sr2 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_2);
+	sr3 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_3);
+	QSPI_Flash_PowerDown();
+
+	rsp->CfgFlashDevInfoRsp.ManufacturerID  = mf;
+	rsp->CfgFlashDevInfoRsp.DeviceID        = id;
+	rsp->CfgFlashDevInfoRsp.JEDECType       = jedec_type;
+	rsp->CfgFlashDevInfoRsp.JEDECCapacity   = jedec_cap;
+	rsp->CfgFlashDevInfoRsp.StatusRegister1 = sr1;
+	rsp->CfgFlashDevInfoRsp.StatusRegister2 = sr2;
+	rsp->CfgFlashDevInfoRsp.StatusRegister3 = sr3;
+	rsp->CfgFlashDevInfoRsp._Pad[0] = 0;
+	rsp->CmdRsp = HPT_CFG_FLASH_DEV_INFO_RSP;
+	rsp->Length += sizeof(HPT_CfgFlashDevInfoRsp);
+}
+
+/**
+ * @brief Handle analog set calibration counts
+ *
+ * Sets calibration counts for the specified analog unit. NR1B supports units 1 (reset/vwl) and 2 (wp).
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_ana_set_cal_counts(HPT_AnaSetCalCountsCmd *cmd, HPT_MsgRsp *rsp)
+{
+	switch (cmd->AnalogUnit)
+	{
+		case 1:
+			gDac1.CalC0 = cmd->CalC0;
+			gDac1.CalC1 = cmd->CalC1;
+			rsp->CmdRsp = HPT_ANA_SET_CAL_COUNTS_RSP;
+			g_config_save_requested = 1;
+			break;
+		case 2:
+			gDac2.CalC0 = cmd->CalC0;
+			gDac2.CalC1 = cmd->CalC1;
+			rsp->CmdRsp = HPT_ANA_SET_CAL_COUNTS_RSP;
+			g_config_save_requested = 1;
+			break;
+		default:
+			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+			rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+			rsp->FailureRsp.Failures++;
+			break;
+	}
+}
+
+/**
+ * @brief Handle analog set active counts
+ *
+ * Sets counts for the specified analog unit. NR1B supports units 1 (reset/vwl) and 2 (wp).
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_ana_set_active_counts(HPT_AnaSetActiveCountsCmd *cmd, HPT_MsgRsp *rsp)
+{
+	switch (cmd->AnalogUnit)
+	{
+		case 1:
+			DacWriteOutput(1, cmd->UnitCounts);
+			rsp->CmdRsp = HPT_ANA_SET_ACTIVE_COUNTS_RSP;
+			break;
+		case 2:
+			DacWriteOutput(2, cmd->UnitCounts);
+			rsp->CmdRsp = HPT_ANA_SET_ACTIVE_COUNTS_RSP;
+			break;
+		default:
+			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+			rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+			rsp->FailureRsp.Failures++;
+			break;
+	}
+}
+
+/**
+ * @brief Handle analog set settling time model
+ *
+ * Sets how long to wait after a step of the specified analog unit:
+ * SettleC0 + SettleC1 * step in mV, in us. Saved to flash.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_ana_set_settle(HPT_AnaSetSettleCmd *cmd, HPT_MsgRsp *rsp)
+{
+	if (DacSetSettle(cmd->AnalogUnit, cmd->SettleC0, cmd->SettleC1) != DAC_SUCCESS) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+	rsp->CmdRsp = HPT_ANA_SET_SETTLE_RSP;
+	g_config_save_requested = 1;
+}
+
+/**
+ * @brief Handle analog get calibration counts
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_ana_get_cal_counts(HPT_AnaGetCalCountsCmd *cmd, HPT_MsgRsp *rsp)
+{
+	switch (cmd->AnalogUnit)
+	{
+		case 1:
+			rsp->AnaGetCalCountsRsp.CalC0 = gDac1.CalC0;
+			rsp->AnaGetCalCountsRsp.CalC1 = gDac1.CalC1;
+			break;
+		case 2:
+			rsp->AnaGetCalCountsRsp.CalC0 = gDac2.CalC0;
+			rsp->AnaGetCalCountsRsp.CalC1 = gDac2.CalC1;
+			break;
+		default:
+			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+			rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+			rsp->FailureRsp.Failures++;
+			return;
+	}
+	rsp->Length += sizeof(HPT_AnaGetCalCountsRsp);
+	rsp->CmdRsp = HPT_ANA_GET_CAL_COUNTS_RSP;
+}
+
+/**
+ * @brief Handle job status request
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_job_status_cmd(HPT_JobCmd *cmd, HPT_MsgRsp *rsp)
+{
+	comms_job *job = comms_job_find(cmd->JobId);
+	uint32_t now = HAL_GetTick();
+
+	if (job == NULL) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	HPT_JobStatusRsp *status = &rsp->JobStatusRsp;
+	status->JobId    = job->Id;
+	status->Cmd      = job->Cmd;
+	status->State    = job->State;
+	status->Progress = job->Progress;
+	status->Total    = job->Total;
+	status->Failure  = (HPT_FailureCode){ 0 };
+	switch (job->State) {
+		case HPT_JOB_STATE_QUEUED:
+			status->QueuedMs = now - job->SubmitTick;
+			status->RunMs    = 0;
+			break;
+		case HPT_JOB_STATE_RUNNING:
+			status->QueuedMs = job->StartTick - job->SubmitTick;
+			status->RunMs    = now - job->StartTick;
+			break;
+		default:
+			status->QueuedMs = job->StartTick - job->SubmitTick;
+			status->RunMs    = job->EndTick - job->StartTick;
+			if (job->Result.CmdRsp == HPT_FAILED_COMMAND_RSP && job->Result.FailureRsp.Failures > 0)
+				status->Failure = job->Result.FailureRsp.FailureCodes[0];
+			break;
+	}
+
+	rsp->CmdRsp = HPT_JOB_STATUS_RSP;
+	rsp->Length += sizeof(HPT_JobStatusRsp);
+}
+
+/**
+ * @brief Handle job result request
+ *
+ * Returns the finished job's own response, as sent when it completed.
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_job_result_cmd(HPT_JobCmd *cmd, HPT_MsgRsp *rsp)
+{
+	comms_job *job = comms_job_find(cmd->JobId);
+
+	if (job == NULL || job->State == HPT_JOB_STATE_QUEUED || job->State == HPT_JOB_STATE_RUNNING) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = job ? HPT_FAILURE_CODE_CMD_BUSY : HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	// Result is finalized: copy it less its CRC, which is recalculated
+	memcpy(rsp, &job->Result, job->Result.Length - HPT_SIZE_OF_CRC);
+	if (rsp->CmdRsp == HPT_FAILED_COMMAND_RSP) {
+		// failure payload is counted again when finalized
+		rsp->Length -= sizeof(rsp->FailureRsp.Failures) + sizeof(HPT_FailureCode) * rsp->FailureRsp.Failures;
+	}
+}
+
+/**
+ * @brief Handle job cancel request
+ *
+ * A queued job is skipped. A running job stops at its next step and
+ * fails with HPT_FAILURE_CODE_CMD_CANCELLED; some steps (e.g. a chip erase)
+ * cannot be interrupted.
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_job_cancel_cmd(HPT_JobCmd *cmd, HPT_MsgRsp *rsp)
+{
+	comms_job *job = comms_job_find(cmd->JobId);
+
+	if (job == NULL || (job->State != HPT_JOB_STATE_QUEUED && job->State != HPT_JOB_STATE_RUNNING)) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	job->Cancel = 1;
+	if (job == m_job_running)
+		gDetAbort = 1;
+
+	rsp->CmdRsp = HPT_JOB_CANCEL_RSP;
+}
+
+/**
+ * @brief Handle USB interrupt residency request
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_diag_isr_cmd(HPT_DiagIsrCmd *cmd, HPT_MsgRsp *rsp)
+{
+	uint64_t total = gIsrUsbTotalCycles;
+
+	rsp->DiagIsrRsp.Calls         = gIsrUsbCalls;
+	rsp->DiagIsrRsp.MaxCycles     = gIsrUsbMaxCycles;
+	rsp->DiagIsrRsp.TotalCyclesLo = (uint32_t)total;
+	rsp->DiagIsrRsp.TotalCyclesHi = (uint32_t)(total >> 32);
+	rsp->DiagIsrRsp.CoreClockHz   = SystemCoreClock;
+
+	if (cmd->Reset) {
+		gIsrUsbCalls       = 0;
+		gIsrUsbMaxCycles   = 0;
+		gIsrUsbTotalCycles = 0;
+	}
+
+	rsp->CmdRsp = HPT_DIAG_ISR_RSP;
+	rsp->Length += sizeof(HPT_DiagIsrRsp);
+}
+
+/**
+ * @brief Handle byte-swap benchmark request
+ *
+ * Compares swapping detector reads in the MDMA with the CPU kernels.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_bench_swap_cmd(HPT_BenchSwapCmd *cmd, HPT_MsgRsp *rsp)
+{
+	DetSwapBench bench;
+
+	DetExitVtMode();
+	rsp->BenchSwapRsp.NumWords         = DetCmdBenchSwap(cmd->BaseAddress, cmd->NumWords, &bench);
+	rsp->BenchSwapRsp.ScalarCycles     = bench.Scalar;
+	rsp->BenchSwapRsp.Rev16Cycles      = bench.Rev16;
+	rsp->BenchSwapRsp.ReadMdmaCycles   = bench.ReadMdma;
+	rsp->BenchSwapRsp.ReadRev16Cycles  = bench.ReadRev16;
+	rsp->BenchSwapRsp.ReadScalarCycles = bench.ReadScalar;
+	rsp->BenchSwapRsp.CoreClockHz      = SystemCoreClock;
+
+	rsp->CmdRsp = HPT_BENCH_SWAP_RSP;
+	rsp->Length += sizeof(HPT_BenchSwapRsp);
+}
+
+/**
+ * @brief Handle OSPI word access benchmark request
+ *
+ * Compares the HAL and register-level single-word read and write paths.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_bench_ospi_cmd(HPT_BenchOspiCmd *cmd, HPT_MsgRsp *rsp)
+{
+	DetOspiBench bench;
+
+	DetExitVtMode();
+	rsp->BenchOspiRsp.NumWords        = DetCmdBenchOspi(cmd->BaseAddress, cmd->NumWords, &bench);
+	rsp->BenchOspiRsp.ReadHalCycles   = bench.ReadHal;
+	rsp->BenchOspiRsp.ReadFastCycles  = bench.ReadFast;
+	rsp->BenchOspiRsp.WriteHalCycles  = bench.WriteHal;
+	rsp->BenchOspiRsp.WriteFastCycles = bench.WriteFast;
+	rsp->BenchOspiRsp.Mismatches      = bench.Mismatches;
+	rsp->BenchOspiRsp.CoreClockHz     = SystemCoreClock;
+
+	rsp->CmdRsp = HPT_BENCH_OSPI_RSP;
+	rsp->Length += sizeof(HPT_BenchOspiRsp);
+}
+
+static LogCursor m_log_usb;	// USB reader position, independent of the UART drain
+
+/**
+ * @brief Handle log read request
+ *
+ * Returns as many pending log lines as fit. Read until NumBytes is 0 to
+ * empty the log.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd Command
+ * @param rsp Response
+ */
+void comms_hpt_handle_log_read_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+{
+	UNUSED(cmd);
+
+	uint32_t lost = m_log_usb.Lost;
+	uint32_t len = 0;
+	for (;;) {
+		uint32_t n = LogFormatNext(&m_log_usb, rsp->LogReadRsp.Text + len, sizeof(rsp->LogReadRsp.Text) - len);
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	rsp->LogReadRsp.Lost     = m_log_usb.Lost - lost;
+	rsp->LogReadRsp.NumBytes = len;
+
+	rsp->CmdRsp = HPT_LOG_READ_RSP;
+	rsp->Length += 2*sizeof(uint32_t) + ((len + 3) & ~3u); // round up to nearest 4-byte boundary
+}
+
+/**
+ * @brief Initialize a response header
+ *
+ * Response defaults to unknown command with no payload.
+ *
+ * @param rsp Response
+ */
+static void comms_hpt_rsp_init(HPT_MsgRsp *rsp)
+{
+	rsp->StartChar = HPT_MSG_SOM_CHAR;
+	rsp->CmdRsp = HPT_UNKNOWN_COMMAND_RSP;
+	rsp->Length = HPT_SIZE_OF_HEADER + HPT_SIZE_OF_CRC;
+	// Start FailureRsp.Failures at 0 so failures can be appended
+	rsp->FailureRsp.Failures = 0;
+}
+
+/**
+ * @brief Add the failure payload of a failed response to its length
+ *
+ * @param rsp Response
+ */
+static void comms_hpt_rsp_size_failures(HPT_MsgRsp *rsp)
+{
+	if (rsp->CmdRsp == HPT_FAILED_COMMAND_RSP) {
+		rsp->Length += sizeof(rsp->FailureRsp.Failures);
+		rsp->Length += sizeof(HPT_FailureCode) * rsp->FailureRsp.Failures;
+	}
+}
+
+/**
+ * @brief Finalize a response: size failure payload and append CRC
+ *
+ * @note Uses the CRC peripheral, which is shared with the USB interrupt
+ *
+ * @param rsp Response
+ */
+static void comms_hpt_rsp_finalize(HPT_MsgRsp *rsp)
 {
-	QSPI_Flash_ReleasePowerDown();
-	rsp->CmdRsp = HPT_CFG_FLASH_ERASE_RSP;
-	switch (cmd->EraseType) {
-		case 0: QSPI_Flash_EraseSector(cmd->Address); break;
-		case 1: QSPI_Flash_EraseBlock32(cmd->Address); break;
-		case 2: QSPI_Flash_EraseBlock64(cmd->Address); break;
-		case 3: QSPI_Flash_EraseChip(); break;
-		default:
-			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
-			rsp->FailureRsp.FailureCodes[g_msg_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
-			rsp->FailureRsp.Failures++;
-			break;
+	comms_hpt_rsp_size_failures(rsp);
+
+	if (rsp->Length != 0) {
+		uint32_t crc_index = (rsp->Length-4)/4;
+		rsp->RawData32Bit[crc_index] = HAL_CRC_Calculate(&hcrc, rsp->RawData32Bit, crc_index);
 	}
-	QSPI_Flash_PowerDown();
 }
 
 /**
- * @brief Handle config flash get device info
- * 
- * @note Runs in USB interrupt
- * 
- * @param cmd Command
+ * @brief Send a response from the main loop
+ *
+ * Finalizes and queues the response for transmission. The response buffer
+ * must not be modified until the transmission completes.
+ *
+ * @note Runs in main loop
+ *
  * @param rsp Response
  */
-void comms_hpt_handle_cfg_flash_dev_info_cmd(HPT_NoDataCmdRsp *cmd, HPT_MsgRsp *rsp)
+static void comms_usb_hpt_send_rsp(HPT_MsgRsp *rsp)
 {
-	UNUSED(cmd);
-	uint8_t mf, id, jedec_type, jedec_cap;
-	uint8_t sr1, sr2, sr3;
-
-	QSPI_Flash_ReleasePowerDown();
-	QSPI_Flash_ReadMfgDevID(&mf, &id);
-	QSPI_Flash_ReadJEDECID(&mf, &jedec_type, &jedec_cap);
-	QSPI_Flash_ReadUniqueID(rsp->CfgFlashDevInfoRsp.UniqueID);
-	sr1 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_1);
-	sr2 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_2);
-	sr3 = QSPI_Flash_ReadStatusReg(QSPI_FLASH_STATUS_REG_3);
-	QSPI_Flash_PowerDown();
+	uint8_t status;
+	do {
+		NVIC_DisableIRQ(OTG_HS_IRQn);
+		comms_hpt_rsp_finalize(rsp);
+		status = CDC_TransmitOrQueue_HS((uint8_t *)rsp, rsp->Length);
+		NVIC_EnableIRQ(OTG_HS_IRQn);
+	} while (status == USBD_BUSY);
+}
 
-	rsp->CfgFlashDevInfoRsp.ManufacturerID  = mf;
-	rsp->CfgFlashDevInfoRsp.DeviceID        = id;
-	rsp->CfgFlashDevInfoRsp.JEDECType       = jedec_type;
-	rsp->CfgFlashDevInfoRsp.JEDECCapacity   = jedec_cap;
-	rsp->CfgFlashDevInfoRsp.StatusRegister1 = sr1;
-	rsp->CfgFlashDevInfoRsp.StatusRegister2 = sr2;
-	rsp->CfgFlashDevInfoRsp.StatusRegister3 = sr3;
-	rsp->CfgFlashDevInfoRsp._Pad[0] = 0;
-	rsp->CmdRsp = HPT_CFG_FLASH_DEV_INFO_RSP;
-	rsp->Length += sizeof(HPT_CfgFlashDevInfoRsp);
+/**
+ * @brief Wait until all queued responses have been sent
+ *
+ * @note Runs in main loop
+ */
+static void comms_usb_hpt_wait_tx_idle(void)
+{
+	while (!CDC_IsTxIdle_HS()) ;
 }
 
 /**
- * @brief Handle analog set calibration counts
+ * @brief Run a command to completion
  *
- * Sets calibration counts for the specified analog unit. NR1B supports units 1 (reset/vwl) and 2 (wp).
+ * Runs any command except batch synchronously, whether it is normally
+ * handled in the USB interrupt or dispatched to the main loop.
  *
- * @note Runs in USB interrupt
+ * @note Runs in USB interrupt for commands without detector or analog access, otherwise in main loop
  *
- * @param cmd Command
- * @param rsp Response
+ * @param msg Command message
+ * @param rsp Response, initialized by caller
  */
-void comms_hpt_handle_ana_set_cal_counts(HPT_AnaSetCalCountsCmd *cmd, HPT_MsgRsp *rsp)
+static void comms_hpt_execute(HPT_MsgCmd *msg, HPT_MsgRsp *rsp)
 {
-	switch (cmd->AnalogUnit)
-	{
-		case 1:
-			gDac1.CalC0 = cmd->CalC0;
-			gDac1.CalC1 = cmd->CalC1;
-			rsp->CmdRsp = HPT_ANA_SET_CAL_COUNTS_RSP;
-			g_config_save_requested = 1;
+	switch (msg->CmdRsp) {
+		case HPT_PING_CMD:
+			comms_hpt_handle_ping_cmd(&msg->NoDataCmdRsp, rsp);
 			break;
-		case 2:
-			gDac2.CalC0 = cmd->CalC0;
-			gDac2.CalC1 = cmd->CalC1;
-			rsp->CmdRsp = HPT_ANA_SET_CAL_COUNTS_RSP;
-			g_config_save_requested = 1;
+		case HPT_VT_GET_BIT_COUNT_KPAGE_CMD:
+			comms_hpt_handle_vt_get_bit_count_kpage_cmd(&msg->VtGetBitCountKPageCmd, rsp);
+			break;
+		case HPT_ERASE_CHIP_CMD:
+			comms_hpt_handle_erase_chip_cmd(&msg->NoDataCmdRsp, rsp);
+			break;
+		case HPT_ERASE_SECTOR_CMD:
+			comms_hpt_handle_erase_sector_cmd(&msg->EraseSectorCmd, rsp);
+			break;
+		case HPT_PROGRAM_SECTOR_CMD:
+			comms_hpt_handle_program_sector_cmd(&msg->ProgramSectorCmd, rsp);
+			break;
+		case HPT_PROGRAM_CHIP_CMD:
+			comms_hpt_handle_program_chip_cmd(&msg->ProgramChipCmd, rsp);
+			break;
+		case HPT_GET_SECTOR_BIT_COUNT_CMD:
+			comms_hpt_handle_get_sector_bit_count_cmd(&msg->GetSectorBitCountCmd, rsp);
+			break;
+		case HPT_VT_SWEEP_CMD:
+			comms_hpt_handle_vt_sweep_cmd(&msg->VtSweepCmd, rsp);
+			break;
+		case HPT_VT_MAP_CMD:
+			comms_hpt_handle_vt_map_cmd(&msg->VtMapCmd, rsp);
+			break;
+		case HPT_FIND_FLIPS_CMD:
+			comms_hpt_handle_find_flips_cmd(&msg->FindFlipsCmd, rsp);
+			break;
+		case HPT_FINGERPRINT_CHIP_CMD:
+			comms_hpt_handle_fingerprint_chip_cmd(&msg->FingerprintChipCmd, rsp);
+			break;
+		case HPT_READ_DATA_CMD:
+			comms_hpt_handle_read_data_cmd(&msg->ReadDataCmd, rsp);
+			break;
+		case HPT_READ_DATA_RLE_CMD:
+			comms_hpt_handle_read_data_rle_cmd(&msg->ReadDataRleCmd, rsp);
+			break;
+		case HPT_WRITE_DATA_CMD:
+			comms_hpt_handle_write_data_cmd(&msg->WriteDataCmd, rsp);
+			break;
+		case HPT_READ_WORD_CMD:
+			comms_hpt_handle_read_word_cmd(&msg->ReadWordCmd, rsp);
+			break;
+		case HPT_WRITE_CFG_CMD:
+			comms_hpt_handle_write_cfg_cmd(&msg->WriteCfgCmd, rsp);
+			break;
+		case HPT_READ_CFG_CMD:
+			comms_hpt_handle_read_cfg_cmd(&msg->ReadCfgCmd, rsp);
+			break;
+		case HPT_CFG_FLASH_ENTER_CMD:
+			comms_hpt_handle_cfg_flash_enter_cmd(&msg->NoDataCmdRsp, rsp);
+			break;
+		case HPT_CFG_FLASH_EXIT_CMD:
+			comms_hpt_handle_cfg_flash_exit_cmd(&msg->NoDataCmdRsp, rsp);
+			break;
+		case HPT_CFG_FLASH_READ_CMD:
+			comms_hpt_handle_cfg_flash_read_cmd(&msg->CfgFlashReadCmd, rsp);
+			break;
+		case HPT_CFG_FLASH_WRITE_CMD:
+			comms_hpt_handle_cfg_flash_write_cmd(&msg->CfgFlashWriteCmd, rsp);
+			break;
+		case HPT_CFG_FLASH_ERASE_CMD:
+			comms_hpt_handle_cfg_flash_erase_cmd(&msg->CfgFlashEraseCmd, rsp);
+			break;
+		case HPT_CFG_FLASH_DEV_INFO_CMD:
+			comms_hpt_handle_cfg_flash_dev_info_cmd(&msg->NoDataCmdRsp, rsp);
+			break;
+		case HPT_ANA_GET_CAL_COUNTS_CMD:
+			comms_hpt_handle_ana_get_cal_counts(&msg->AnaGetCalCountsCmd, rsp);
+			break;
+		case HPT_ANA_SET_CAL_COUNTS_CMD:
+			comms_hpt_handle_ana_set_cal_counts(&msg->AnaSetCalCountsCmd, rsp);
+			break;
+		case HPT_ANA_SET_ACTIVE_COUNTS_CMD:
+			comms_hpt_handle_ana_set_active_counts(&msg->AnaSetActiveCountsCmd, rsp);
+			break;
+		case HPT_ANA_SET_SETTLE_CMD:
+			comms_hpt_handle_ana_set_settle(&msg->AnaSetSettleCmd, rsp);
+			break;
+		case HPT_JOB_STATUS_CMD:
+			comms_hpt_handle_job_status_cmd(&msg->JobCmd, rsp);
+			break;
+		case HPT_JOB_RESULT_CMD:
+			comms_hpt_handle_job_result_cmd(&msg->JobCmd, rsp);
+			break;
+		case HPT_JOB_CANCEL_CMD:
+			comms_hpt_handle_job_cancel_cmd(&msg->JobCmd, rsp);
+			break;
+		case HPT_DIAG_ISR_CMD:
+			comms_hpt_handle_diag_isr_cmd(&msg->DiagIsrCmd, rsp);
+			break;
+		case HPT_LOG_READ_CMD:
+			comms_hpt_handle_log_read_cmd(&msg->NoDataCmdRsp, rsp);
+			break;
+		case HPT_BENCH_SWAP_CMD:
+			comms_hpt_handle_bench_swap_cmd(&msg->BenchSwapCmd, rsp);
+			break;
+		case HPT_BENCH_OSPI_CMD:
+			comms_hpt_handle_bench_ospi_cmd(&msg->BenchOspiCmd, rsp);
+			break;
+		case HPT_ERASE_SECTORS_CMD:
+			comms_hpt_handle_erase_sectors_cmd(&msg->EraseSectorsCmd, rsp);
 			break;
 		default:
-			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
-			rsp->FailureRsp.FailureCodes[g_msg_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
-			rsp->FailureRsp.Failures++;
+			rsp->CmdRsp = HPT_UNKNOWN_COMMAND_RSP;
 			break;
 	}
 }
 
 /**
- * @brief Handle analog set active counts
+ * @brief Append a sub-response to a batch response
  *
- * Sets counts for the specified analog unit. NR1B supports units 1 (reset/vwl) and 2 (wp).
+ * @param rsp    Batch response
+ * @param offset Offset of the next sub-response in rsp->BatchRsp.Rsps
+ * @param sub    Sub-response, finished except for the CRC
+ * @return uint32_t Offset after the sub-response
+ */
+static uint32_t comms_hpt_batch_append(HPT_MsgRsp *rsp, uint32_t offset, HPT_MsgRsp *sub)
+{
+	sub->Length -= HPT_SIZE_OF_CRC;
+	memcpy(&rsp->BatchRsp.Rsps[offset], sub, sub->Length);
+	return offset + ((sub->Length + 3) & ~3u);
+}
+
+/**
+ * @brief Handle batch request
  *
- * @note Runs in USB interrupt
+ * Runs each sub-command in order and returns the sub-responses concatenated.
+ * When the next sub-response does not fit, the batch response so far is sent
+ * and a new one started, so the host may receive several batch responses.
+ * Batches do not nest.
  *
- * @param cmd Command
- * @param rsp Response
+ * The command slot is reused, so only the bytes received are parsed: the
+ * batch is rejected unless its NumCmds sub-commands fill them exactly.
+ *
+ * @note Runs in main loop
+ *
+ * @param cmd  Command
+ * @param size Payload bytes received (message length without header and CRC)
+ * @param rsp  Response
  */
-void comms_hpt_handle_ana_set_active_counts(HPT_AnaSetActiveCountsCmd *cmd, HPT_MsgRsp *rsp)
+void comms_hpt_handle_batch_cmd(HPT_BatchCmd *cmd, uint32_t size, HPT_MsgRsp *rsp)
 {
-	switch (cmd->AnalogUnit)
-	{
-		case 1:
-			DacWriteOutput(1, cmd->UnitCounts);
-			rsp->CmdRsp = HPT_ANA_SET_ACTIVE_COUNTS_RSP;
-			break;
-		case 2:
-			DacWriteOutput(2, cmd->UnitCounts);
-			rsp->CmdRsp = HPT_ANA_SET_ACTIVE_COUNTS_RSP;
+	uint32_t in    = 0;	// offset in cmd->Cmds
+	uint32_t out   = 0;	// offset in rsp->BatchRsp.Rsps
+	uint32_t first = 0;	// index of first sub-response in rsp
+	uint32_t index = 0;
+
+	uint32_t avail = size > offsetof(HPT_BatchCmd, Cmds) ? size - offsetof(HPT_BatchCmd, Cmds) : 0;
+	for (index = 0; index < cmd->NumCmds; index++) {
+		uint32_t len = 0;
+		if (in + HPT_SIZE_OF_HEADER <= avail)
+			len = ((HPT_MsgCmd *)&cmd->Cmds[in])->Length;
+		if (len < HPT_SIZE_OF_HEADER || len > avail - in)
 			break;
-		default:
-			rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
-			rsp->FailureRsp.FailureCodes[g_msg_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
-			rsp->FailureRsp.Failures++;
+		in += (len + 3) & ~3u;
+	}
+	if (size < offsetof(HPT_BatchCmd, Cmds) || avail > sizeof(cmd->Cmds) || index < cmd->NumCmds || in != avail) {
+		LOG_ERROR("[comms_hpt_handle_batch_cmd] %lu sub-commands do not fill %lu bytes", cmd->NumCmds, avail);
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+		rsp->FailureRsp.Failures++;
+		return;
+	}
+
+	in    = 0;
+	index = 0;
+	while (index < cmd->NumCmds && !gDetAbort) {
+		comms_job_progress(index, cmd->NumCmds);
+		HPT_MsgCmd *sub = (HPT_MsgCmd *)&cmd->Cmds[in];
+		uint32_t len = sub->Length;
+
+		comms_hpt_rsp_init(&m_batch_rsp);
+		if (sub->CmdRsp == HPT_BATCH_CMD) {
+			m_batch_rsp.CmdRsp = HPT_FAILED_COMMAND_RSP;
+			m_batch_rsp.FailureRsp.FailureCodes[m_batch_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_INVALID_PARAM;
+			m_batch_rsp.FailureRsp.Failures++;
+		} else {
+			// copy so the handler sees a whole zero-padded message
+			memset(&m_batch_cmd, 0, sizeof(m_batch_cmd));
+			memcpy(&m_batch_cmd, sub, len);
+			comms_hpt_execute(&m_batch_cmd, &m_batch_rsp);
+		}
+		comms_hpt_rsp_size_failures(&m_batch_rsp);
+
+		if (out > 0 && out + m_batch_rsp.Length - HPT_SIZE_OF_CRC > sizeof(rsp->BatchRsp.Rsps)) {
+			// full: send what we have and continue in a new response
+			rsp->CmdRsp = HPT_BATCH_RSP;
+			rsp->BatchRsp.FirstIndex = first;
+			rsp->BatchRsp.NumRsps    = index - first;
+			rsp->BatchRsp.Last       = 0;
+			rsp->Length += 2*sizeof(uint32_t) + out;
+			comms_usb_hpt_send_rsp(rsp);
+			comms_usb_hpt_wait_tx_idle();
+			comms_hpt_rsp_init(rsp);
+			out   = 0;
+			first = index;
+		}
+		out = comms_hpt_batch_append(rsp, out, &m_batch_rsp);
+		index++;
+
+		if (m_batch_rsp.CmdRsp == HPT_FAILED_COMMAND_RSP && cmd->StopOnFailure)
 			break;
+		in += (len + 3) & ~3u;
 	}
+
+	rsp->CmdRsp = HPT_BATCH_RSP;
+	rsp->BatchRsp.FirstIndex = first;
+	rsp->BatchRsp.NumRsps    = index - first;
+	rsp->BatchRsp.Last       = 1;
+	rsp->Length += 2*sizeof(uint32_t) + out;
 }
 
 /**
@@ -430,160 +1662,95 @@ void comms_hpt_handle_ana_set_active_counts(HPT_AnaSetActiveCountsCmd *cmd, HPT_
  *
  * Receives an HPT Bus message from the comms subsystem.
  * Simple messages (e.g. ping) are handled here, otherwise
- * this function calls other functions or sets flags to
- * perform the request.
+ * this function sets flags to perform the request in the
+ * main loop.
  *
  * @note Runs in USB interrupt
- * @note Fills out global message response structure @ref g_msg_rsp
  *
  * @param msg Incoming HPT Bus message
+ * @param rsp Response, filled out here
  * @return uint32_t Length of response. Zero indicates no response.
  */
-uint32_t comms_usb_hpt_receive_msg(HPT_MsgCmd *msg)
+static uint32_t comms_usb_hpt_receive_msg(HPT_MsgCmd *msg, HPT_MsgRsp *rsp)
 {
+	HPT_CmdRespEnum cmd = msg->CmdRsp;
+	LOG_DEBUG("Received message %lu", cmd);
 
-// Dispatch a long message for further processing, if detector is available
-#define COMMS_CHECK_DISPATCH(M) do { \
-	if (g_comms_cmd_req == HPT_NULL_MSG_CMD) { \
-		g_msg_rsp.CmdRsp = M##_RSP; \
-		memcpy(&m_cmd_copy, msg, sizeof(HPT_MsgCmd)); \
-		g_comms_cmd_req = M##_CMD; \
-	} else { g_msg_rsp.CmdRsp = HPT_FAILED_COMMAND_RSP; \
-			g_msg_rsp.FailureRsp.FailureCodes[g_msg_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_BUSY; \
-			g_msg_rsp.FailureRsp.Failures++; } \
-} while (0)
-
-	puts("Received message");
+	// we send a message unless the command is deferred
+	comms_hpt_rsp_init(rsp);
 
-	HPT_CmdRespEnum cmd = msg->CmdRsp;
+	bool dispatch;
+	switch (cmd) {
+		case HPT_PING_CMD:
+		case HPT_ANA_GET_CAL_COUNTS_CMD:
+		case HPT_JOB_STATUS_CMD:
+		case HPT_JOB_RESULT_CMD:
+		case HPT_JOB_CANCEL_CMD:
+		case HPT_DIAG_ISR_CMD:
+			// no detector or analog access: answered here, even while the detector is busy
+			dispatch = false;
+			break;
+		default:
+			// everything else runs in the main loop, in the order received
+			dispatch = true;
+			break;
+	}
 
-	// we unconditionally send a message
-	g_msg_rsp.StartChar = HPT_MSG_SOM_CHAR;
-	g_msg_rsp.CmdRsp = HPT_UNKNOWN_COMMAND_RSP;
-	g_msg_rsp.Length = HPT_SIZE_OF_HEADER + HPT_SIZE_OF_CRC;
-	// Start FailureRsp.Failures at 0 so failures can be appended
-	g_msg_rsp.FailureRsp.Failures = 0;
-
-	if (cmd == HPT_PING_CMD) {
-		g_msg_rsp.Length += sizeof(HPT_PingRsp);
-		g_msg_rsp.CmdRsp = HPT_PING_RSP;
-		g_msg_rsp.PingRsp.UptimeSeconds = HAL_GetTick() / 1000;
-		g_msg_rsp.PingRsp.VersionString[0] = 'N';
-		g_msg_rsp.PingRsp.VersionString[1] = 'R';
-		g_msg_rsp.PingRsp.VersionString[2] = '1';
-		g_msg_rsp.PingRsp.VersionString[3] = ' ';
-		g_msg_rsp.PingRsp.VersionString[4] = 't';
-		g_msg_rsp.PingRsp.VersionString[5] = 'e';
-		g_msg_rsp.PingRsp.VersionString[6] = 's';
-		g_msg_rsp.PingRsp.VersionString[7] = 't';
-		g_msg_rsp.PingRsp.VersionString[8] = '\0';
-		for (uint32_t i=9; i<16; i++) g_msg_rsp.PingRsp.VersionString[i] = 0;
-		g_msg_rsp.PingRsp.IsDetectorBusy   = g_comms_cmd_req != HPT_NULL_MSG_CMD;
-		g_msg_rsp.PingRsp.ResetFlags       = gResetFlags;
-		g_msg_rsp.PingRsp.Task             = g_comms_cmd_req;
-		g_msg_rsp.PingRsp.TaskState        = g_comms_cmd_req_state;
-	} else if (cmd == HPT_ANA_GET_CAL_COUNTS_CMD && (msg->AnaGetCalCountsCmd.AnalogUnit == 1 || msg->AnaGetCalCountsCmd.AnalogUnit == 2)) {
-		// Parse DAC unit
-		float CalC0 = 0, CalC1 = 0;
-		switch (msg->AnaGetCalCountsCmd.AnalogUnit) {
-			case 1:
-				CalC0 = gDac1.CalC0;
-				CalC1 = gDac1.CalC1;
-				break;
-			case 2:
-				CalC0 = gDac2.CalC0;
-				CalC1 = gDac2.CalC1;
-				break;
-		}
-		// Send response
-		g_msg_rsp.Length += sizeof(HPT_AnaGetCalCountsRsp);
-		g_msg_rsp.CmdRsp = HPT_ANA_GET_CAL_COUNTS_RSP;
-		g_msg_rsp.AnaGetCalCountsRsp.CalC0 = CalC0;
-		g_msg_rsp.AnaGetCalCountsRsp.CalC1 = CalC1;
-	} else if (g_comms_cmd_req != HPT_NULL_MSG_CMD) {
-		// Command in progress
-		g_msg_rsp.CmdRsp = HPT_FAILED_COMMAND_RSP;
-		g_msg_rsp.FailureRsp.FailureCodes[g_msg_rsp.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_BUSY;
-		g_msg_rsp.FailureRsp.Failures++;
+	uint32_t job_id = 0;
+	if (!dispatch) {
+		comms_hpt_execute(msg, rsp);
+	} else if ((job_id = comms_cmd_enqueue(msg)) == 0) {
+		rsp->CmdRsp = HPT_FAILED_COMMAND_RSP;
+		rsp->FailureRsp.FailureCodes[rsp->FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_BUSY;
+		rsp->FailureRsp.Failures++;
+	} else if (comms_cmd_is_acked(cmd)) {
+		// each response ID follows its command ID
+		rsp->CmdRsp = (HPT_CmdRespEnum)(cmd + 1);
+		rsp->JobSubmitRsp.JobId = job_id;
+		rsp->Length += sizeof(HPT_JobSubmitRsp);
 	} else {
-		switch (cmd) {
-			case HPT_VT_GET_BIT_COUNT_KPAGE_CMD:
-				comms_hpt_handle_vt_get_bit_count_kpage_cmd(&msg->VtGetBitCountKPageCmd, &g_msg_rsp);
-				break;
-			case HPT_ERASE_CHIP_CMD:
-				COMMS_CHECK_DISPATCH(HPT_ERASE_CHIP);
-				break;
-			case HPT_ERASE_SECTOR_CMD:
-				COMMS_CHECK_DISPATCH(HPT_ERASE_SECTOR);
-				break;
-			case HPT_PROGRAM_SECTOR_CMD:
-				COMMS_CHECK_DISPATCH(HPT_PROGRAM_SECTOR);
-				break;
-			case HPT_PROGRAM_CHIP_CMD:
-				COMMS_CHECK_DISPATCH(HPT_PROGRAM_CHIP);
-				break;
-			case HPT_GET_SECTOR_BIT_COUNT_CMD:
-				comms_hpt_handle_get_sector_bit_count_cmd(&msg->GetSectorBitCountCmd, &g_msg_rsp);
-				break;
-			case HPT_READ_DATA_CMD:
-				comms_hpt_handle_read_data_cmd(&msg->ReadDataCmd, &g_msg_rsp);
-				break;
-			case HPT_WRITE_DATA_CMD:
-				COMMS_CHECK_DISPATCH(HPT_WRITE_DATA);
-				break;
-			case HPT_READ_WORD_CMD:
-				comms_hpt_handle_read_word_cmd(&msg->ReadWordCmd, &g_msg_rsp);
-				break;
-			case HPT_WRITE_CFG_CMD:
-				comms_hpt_handle_write_cfg_cmd(&msg->WriteCfgCmd, &g_msg_rsp);
-				break;
-			case HPT_READ_CFG_CMD:
-				comms_hpt_handle_read_cfg_cmd(&msg->ReadCfgCmd, &g_msg_rsp);
-				break;
-			case HPT_CFG_FLASH_ENTER_CMD:
-				comms_hpt_handle_cfg_flash_enter_cmd(&msg->NoDataCmdRsp, &g_msg_rsp);
-				break;
-			case HPT_CFG_FLASH_EXIT_CMD:
-				comms_hpt_handle_cfg_flash_exit_cmd(&msg->NoDataCmdRsp, &g_msg_rsp);
-				break;
-			case HPT_CFG_FLASH_READ_CMD:
-				comms_hpt_handle_cfg_flash_read_cmd(&msg->CfgFlashReadCmd, &g_msg_rsp);
-				break;
-			case HPT_CFG_FLASH_WRITE_CMD:
-				comms_hpt_handle_cfg_flash_write_cmd(&msg->CfgFlashWriteCmd, &g_msg_rsp);
-				break;
-			case HPT_CFG_FLASH_ERASE_CMD:
-				comms_hpt_handle_cfg_flash_erase_cmd(&msg->CfgFlashEraseCmd, &g_msg_rsp);
-				break;
-			case HPT_CFG_FLASH_DEV_INFO_CMD:
-				comms_hpt_handle_cfg_flash_dev_info_cmd(&msg->NoDataCmdRsp, &g_msg_rsp);
-				break;
-			case HPT_ANA_SET_CAL_COUNTS_CMD:
-				comms_hpt_handle_ana_set_cal_counts(&msg->AnaSetCalCountsCmd, &g_msg_rsp);
-				break;
-			case HPT_ANA_SET_ACTIVE_COUNTS_CMD:
-				comms_hpt_handle_ana_set_active_counts(&msg->AnaSetActiveCountsCmd, &g_msg_rsp);
-				break;
-			default:
-				// g_msg_rsp.Length += 0;
-				g_msg_rsp.CmdRsp = HPT_UNKNOWN_COMMAND_RSP;
-				break;
-		}
+		// response is sent from the main loop when the command completes
+		rsp->Length = 0;
 	}
 
-	if (g_msg_rsp.CmdRsp == HPT_FAILED_COMMAND_RSP) {
-		g_msg_rsp.Length += sizeof(g_msg_rsp.FailureRsp.Failures);
-		g_msg_rsp.Length += sizeof(HPT_FailureCode) * g_msg_rsp.FailureRsp.Failures;
-	}
+	comms_hpt_rsp_finalize(rsp);
+
+	return rsp->Length;
+}
+
+/**
+ * @brief Transmit the response in the next interrupt response buffer
+ *
+ * @note Runs in USB interrupt
+ *
+ * @param rsp m_isr_rsp[m_isr_rsp_head], finalized
+ */
+static void comms_isr_rsp_send(HPT_MsgRsp *rsp)
+{
+	m_isr_rsp_head = (m_isr_rsp_head + 1) % COMMS_ISR_RSP_BUFS;
+	m_isr_rsp_count++;
 
-	if (g_msg_rsp.Length != 0) {
-		uint32_t crc_index = (g_msg_rsp.Length-4)/4;
-		g_msg_rsp.RawData32Bit[crc_index] = HAL_CRC_Calculate(&hcrc, g_msg_rsp.RawData32Bit, crc_index);
+	uint8_t status = CDC_TransmitOrQueue_HS((uint8_t *)rsp, rsp->Length);
+	if (status != USBD_OK) {
+		// never sent, so never released by comms_usb_hpt_tx_done: release it here
+		LOG_WARN("[comms_isr_rsp_send] response %lu dropped: %lu", rsp->CmdRsp, status);
+		m_isr_rsp_head = (m_isr_rsp_head + COMMS_ISR_RSP_BUFS - 1) % COMMS_ISR_RSP_BUFS;
+		m_isr_rsp_count--;
 	}
+}
 
-	return g_msg_rsp.Length;
+void comms_usb_hpt_tx_done(uint8_t *buf)
+{
+	uint32_t tail = (m_isr_rsp_head + COMMS_ISR_RSP_BUFS - m_isr_rsp_count) % COMMS_ISR_RSP_BUFS;
+	// main-loop responses complete in between; interrupt ones complete in order
+	if (m_isr_rsp_count > 0 && buf == (uint8_t *)&m_isr_rsp[tail])
+		m_isr_rsp_count--;
+}
 
-#undef COMMS_CHECK_DISPATCH
+void comms_usb_hpt_tx_abort(void)
+{
+	m_isr_rsp_head  = 0;
+	m_isr_rsp_count = 0;
 }
 
 typedef enum {
@@ -600,30 +1767,28 @@ typedef enum {
 comms_hpt_rx_state g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_START;
 uint32_t g_comms_hpt_rx_count = 0; // payload index
 
-void comms_usb_hpt_receive_bytes(uint8_t *bytes, uint32_t nbytes, void **send_data, uint32_t *send_len)
+uint32_t comms_usb_hpt_receive_bytes(uint8_t *bytes, uint32_t nbytes)
 {
-	printf("rec %ld state=%d\n", nbytes, g_comms_hpt_rx_state);
+	LOG_DEBUG("rec %lu state=%lu", nbytes, g_comms_hpt_rx_state);
 	uint32_t total_crc = 0;
-	*send_data = NULL;
-	*send_len = 0;
 	uint32_t i=0;
 	while (i < nbytes) {
 		switch (g_comms_hpt_rx_state) {
 			case COMMS_HPT_RX_STATE_START:
 				if (bytes[i] == '~') {
-					g_msg_cmd.StartChar = bytes[i];
+					m_rx_cmd->StartChar = bytes[i];
 					g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_LENGTH_0;
 				}
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_LENGTH_0:
-				g_msg_cmd.Length = bytes[i];
+				m_rx_cmd->Length = bytes[i];
 				g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_LENGTH_1;
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_LENGTH_1:
-				g_msg_cmd.Length |= ((uint16_t)bytes[i] << 8);
-				if (g_msg_cmd.Length > (64 + HPT_MAX_CMD_PAYLOAD)) {
+				m_rx_cmd->Length |= ((uint16_t)bytes[i] << 8);
+				if (m_rx_cmd->Length > (64 + HPT_MAX_CMD_PAYLOAD)) {
 					g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_START;
 					break;
 				} else {
@@ -632,47 +1797,47 @@ void comms_usb_hpt_receive_bytes(uint8_t *bytes, uint32_t nbytes, void **send_da
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_CMD:
-				g_msg_cmd.CmdRsp = bytes[i];
+				m_rx_cmd->CmdRsp = bytes[i];
 				g_comms_hpt_rx_count = 0;
 				g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_PAYLOAD;
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_PAYLOAD:
-				while (i < nbytes && g_comms_hpt_rx_count < (uint32_t)(g_msg_cmd.Length - 8)) {
-					g_msg_cmd.RawData[4 + g_comms_hpt_rx_count] = bytes[i];
+				while (i < nbytes && g_comms_hpt_rx_count < (uint32_t)(m_rx_cmd->Length - 8)) {
+					m_rx_cmd->RawData[4 + g_comms_hpt_rx_count] = bytes[i];
 					g_comms_hpt_rx_count++;
 					i++;
 				}
-				if (g_comms_hpt_rx_count == (uint32_t)(g_msg_cmd.Length - 8)) {
+				if (g_comms_hpt_rx_count == (uint32_t)(m_rx_cmd->Length - 8)) {
 					g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_CRC_0;
 				}
 				break;
 			case COMMS_HPT_RX_STATE_CRC_0:
-				g_msg_cmd.RawData[g_msg_cmd.Length - 4] = bytes[i];
+				m_rx_cmd->RawData[m_rx_cmd->Length - 4] = bytes[i];
 				g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_CRC_1;
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_CRC_1:
-				g_msg_cmd.RawData[g_msg_cmd.Length - 3] = bytes[i];
+				m_rx_cmd->RawData[m_rx_cmd->Length - 3] = bytes[i];
 				g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_CRC_2;
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_CRC_2:
-				g_msg_cmd.RawData[g_msg_cmd.Length - 2] = bytes[i];
+				m_rx_cmd->RawData[m_rx_cmd->Length - 2] = bytes[i];
 				g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_CRC_3;
 				i++;
 				break;
 			case COMMS_HPT_RX_STATE_CRC_3:
-				g_msg_cmd.RawData[g_msg_cmd.Length - 1] = bytes[i];
+				// no buffer for the response: leave the rest until one is sent
+				if (m_isr_rsp_count >= COMMS_ISR_RSP_BUFS)
+					return i;
+				m_rx_cmd->RawData[m_rx_cmd->Length - 1] = bytes[i];
 				// validate CRC
-				total_crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)&g_msg_cmd.RawData32Bit[0], g_msg_cmd.Length/4);
+				total_crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)&m_rx_cmd->RawData32Bit[0], m_rx_cmd->Length/4);
 				if (total_crc == 0) {
-					comms_usb_hpt_receive_msg(&g_msg_cmd);
-					// comms_usb_hpt_receive_msg fills out g_msg_rsp
-					if (g_msg_rsp.Length != 0) {
-						*send_data = &g_msg_rsp;
-						*send_len = (uint32_t)g_msg_rsp.Length;
-					}
+					HPT_MsgRsp *rsp = &m_isr_rsp[m_isr_rsp_head];
+					if (comms_usb_hpt_receive_msg(m_rx_cmd, rsp) != 0)
+						comms_isr_rsp_send(rsp);
 				}
 				g_comms_hpt_rx_state = COMMS_HPT_RX_STATE_START;
 				i++;
@@ -682,82 +1847,154 @@ void comms_usb_hpt_receive_bytes(uint8_t *bytes, uint32_t nbytes, void **send_da
 				break;
 		}
 	}
+	return i;
 }
 
-void comms_usb_hpt_receive_bytes_onepacket(uint8_t *bytes, uint32_t nbytes, void **send_data, uint32_t *send_len)
-{
-	// TODO: message split across USB packets?
-	if (nbytes > 7) {
-		uint16_t len = (uint16_t)bytes[1] | ((uint16_t)bytes[2] << 8);
-		if (bytes[0] == '~' && nbytes >= len) {
-			// validate CRC
-			uint32_t total_crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)bytes, len/4);
-			if (total_crc == 0)
-			{
-				// re-interpret as command
-				HPT_MsgCmd *ptr_msg = (HPT_MsgCmd*)bytes;
-				comms_usb_hpt_receive_msg(ptr_msg);
-				// comms_usb_hpt_receive_msg fills out g_msg_rsp
-				if (g_msg_rsp.Length != 0) {
-					*send_data = &g_msg_rsp;
-					*send_len = (uint32_t)g_msg_rsp.Length;
-				} else {
-					*send_data = NULL;
-					*send_len = 0;
-				}
-			}
-		}
-	}
-}
-
-void comms_usb_hpt_tick(void)
+/**
+ * @brief Run the job at the head of the queue
+ *
+ * @note Runs in main loop
+ */
+static void comms_job_run_next(void)
 {
-	// TODO: Request FIFO?
+	uint8_t slot = comms_cmd_ring_peek(&m_cmd_queue);
+	HPT_MsgCmd *cmd = &m_cmd_slots[slot];
+	comms_job *job = &m_jobs[m_cmd_job[slot]];
 
+	// claim before popping so the USB interrupt always sees the detector busy
+	g_comms_cmd_req = cmd->CmdRsp;
 	g_comms_cmd_req_state = 1;
-	switch (g_comms_cmd_req) {
-		case HPT_ERASE_CHIP_CMD:
-			puts("[comms_usb_hpt_tick] Handling HPT_ERASE_CHIP_CMD");
-			g_comms_cmd_req_state = 2;
-			DetReset();
-			g_comms_cmd_req_state = 3;
-			gDetApi->EraseChip();
-			break;
-		case HPT_ERASE_SECTOR_CMD:
-			puts("[comms_usb_hpt_tick] Handling HPT_ERASE_SECTOR_CMD");
-			g_comms_cmd_req_state = 2;
-			DetReset();
-			g_comms_cmd_req_state = 3;
-			gDetApi->EraseSector(m_cmd_copy.EraseSectorCmd.SectorAddress);
-			break;
-		case HPT_PROGRAM_SECTOR_CMD:
-			puts("[comms_usb_hpt_tick] Handling HPT_PROGRAM_SECTOR_CMD");
-			g_comms_cmd_req_state = 2;
-			DetReset();
-			g_comms_cmd_req_state = 3;
-			DetCmdProgramSector(m_cmd_copy.ProgramSectorCmd.SectorAddress, m_cmd_copy.ProgramSectorCmd.ProgramValue);;
-			break;
-		case HPT_PROGRAM_CHIP_CMD:
-			puts("[comms_usb_hpt_tick] Handling HPT_PROGRAM_CHIP_CMD");
-			g_comms_cmd_req_state = 2;
-			DetReset();
-			g_comms_cmd_req_state = 3;
-			for (uint32_t i=0; i<1024; i++) {
-				g_comms_cmd_req_state = 4 + i;
-				DetCmdProgramSector(i * 0x10000, m_cmd_copy.ProgramChipCmd.ProgramValue);
-			}
-			break;
-		case HPT_WRITE_DATA_CMD:
-			puts("[comms_usb_hpt_tick] Handling HPT_WRITE_DATA_CMD");
-			g_comms_cmd_req_state = 2;
-			gDetApi->ProgramBuffer(m_cmd_copy.WriteDataCmd.BaseAddress, m_cmd_copy.WriteDataCmd.Data, m_cmd_copy.WriteDataCmd.NumWords);
-			break;
-		default:
-			if (g_comms_cmd_req != HPT_NULL_MSG_CMD)
-				printf("[comms_usb_hpt_tick] Unimplemented command %d\n", g_comms_cmd_req);
-			break;
+	comms_cmd_ring_pop(&m_cmd_queue);
+
+	LOG_DEBUG("[comms_job_run_next] Handling command %lu (job %lu)", g_comms_cmd_req, job->Id);
+	g_comms_cmd_req_state = 2;
+
+	// the result buffer was last sent COMMS_JOB_HISTORY jobs ago
+	comms_usb_hpt_wait_tx_idle();
+	comms_hpt_rsp_init(&job->Result);
+
+	// a cancel from here on is seen either through job->Cancel or gDetAbort
+	m_job_running = job;
+	gDetAbort = job->Cancel;
+	job->StartTick = HAL_GetTick();
+	job->State = HPT_JOB_STATE_RUNNING;
+
+	if (!gDetAbort) {
+		if (cmd->CmdRsp == HPT_BATCH_CMD)
+			comms_hpt_handle_batch_cmd(&cmd->BatchCmd, cmd->Length - HPT_SIZE_OF_HEADER - HPT_SIZE_OF_CRC, &job->Result);
+		else
+			comms_hpt_execute(cmd, &job->Result);
 	}
 
+	job->EndTick = HAL_GetTick();
+	if (gDetAbort) {
+		comms_hpt_rsp_init(&job->Result);
+		job->Result.CmdRsp = HPT_FAILED_COMMAND_RSP;
+		job->Result.FailureRsp.FailureCodes[job->Result.FailureRsp.Failures] = HPT_FAILURE_CODE_CMD_CANCELLED;
+		job->Result.FailureRsp.Failures++;
+	}
+
+	// acknowledged commands were answered from the USB interrupt
+	if (comms_cmd_is_acked(cmd->CmdRsp)) {
+		NVIC_DisableIRQ(OTG_HS_IRQn);
+		comms_hpt_rsp_finalize(&job->Result);
+		NVIC_EnableIRQ(OTG_HS_IRQn);
+	} else {
+		comms_usb_hpt_send_rsp(&job->Result);
+	}
+
+	if (gDetAbort)
+		job->State = HPT_JOB_STATE_CANCELLED;
+	else if (job->Result.CmdRsp == HPT_FAILED_COMMAND_RSP)
+		job->State = HPT_JOB_STATE_FAILED;
+	else
+		job->State = HPT_JOB_STATE_DONE;
+	m_job_running = NULL;
+	gDetAbort = 0;
+
+	comms_cmd_ring_push(&m_cmd_free, slot);
 	g_comms_cmd_req = HPT_NULL_MSG_CMD;
 	g_comms_cmd_req_state = 0;
 }
+
+/**
+ * @brief Detector range a queued command only reads
+ *
+ * Only plain (not Vt mode) reads of bounded size qualify: they change no
+ * analog state, so they can run while an erase is suspended.
+ *
+ * @return bool Whether cmd is such a read
+ */
+static bool comms_cmd_read_range(HPT_MsgCmd *cmd, uint32_t *address, uint32_t *count)
+{
+	switch (cmd->CmdRsp) {
+		case HPT_READ_DATA_CMD:
+			if (cmd->ReadDataCmd.VtMode)
+				return false;
+			*address = cmd->ReadDataCmd.BaseAddress;
+			*count   = cmd->ReadDataCmd.NumWords;
+			return true;
+		case HPT_READ_DATA_RLE_CMD:
+			if (cmd->ReadDataRleCmd.VtMode)
+				return false;
+			*address = cmd->ReadDataRleCmd.BaseAddress;
+			*count   = cmd->ReadDataRleCmd.NumWords;
+			return true;
+		case HPT_READ_WORD_CMD:
+			if (cmd->ReadWordCmd.VtMode)
+				return false;
+			*address = cmd->ReadWordCmd.WordAddress;
+			*count   = 1;
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * @brief Serve a queued read while a sector erase runs
+ *
+ * If the next job is a plain read of sectors not being erased, suspends
+ * the erase, runs the job and resumes. The read cannot see the result of
+ * anything queued after the erase, so its outcome is as if jobs ran in order.
+ * An erase inside a batch is never suspended: the batch's later
+ * sub-commands must run before the next job.
+ *
+ * @note Runs in main loop, from the erase wait of the running job
+ */
+static void comms_hpt_erase_idle(void)
+{
+	if (comms_cmd_ring_count(&m_cmd_queue) == 0 || m_job_running == NULL || m_job_running->Cmd == HPT_BATCH_CMD)
+		return;
+
+	HPT_MsgCmd *cmd = &m_cmd_slots[comms_cmd_ring_peek(&m_cmd_queue)];
+	uint32_t address, count;
+	if (!comms_cmd_read_range(cmd, &address, &count) || DetEraseTouches(address, count))
+		return;
+
+	if (DetEraseSuspend())
+		return;
+
+	// the erase job is running around this one
+	comms_job *outer = m_job_running;
+	uint8_t req = g_comms_cmd_req;
+	uint32_t req_state = g_comms_cmd_req_state;
+	uint32_t abort = gDetAbort;
+
+	comms_job_run_next();
+
+	g_comms_cmd_req = req;
+	g_comms_cmd_req_state = req_state;
+	m_job_running = outer;
+	__DMB();
+	// a cancel of the erase job while the read ran only set outer->Cancel
+	gDetAbort = abort | outer->Cancel;
+
+	DetEraseResume();
+}
+
+void comms_usb_hpt_tick(void)
+{
+	while (comms_cmd_ring_count(&m_cmd_queue) != 0)
+		comms_job_run_next();
+}
@@ -27,15 +27,32 @@ void comms_usb_hpt_reset(void);
 /**
  * @brief HPT Bus command/response handler.
  * 
- * Validates HPT Bus command and passes data to response handler.
- * Only pass complete messages. Partial messages will result in a CRC error.
+ * Validates HPT Bus commands and passes them to the response handler, which
+ * transmits any response from the USB interrupt. Messages may span calls.
+ * Parsing stops early while every interrupt response buffer is in flight:
+ * pass the rest again after comms_usb_hpt_tx_done has released one.
+ * 
+ * @note Runs in USB interrupt
  * 
  * @param bytes     Pointer to received bytes
  * @param nbytes    Number of bytes received
- * @param send_data Pointer to response data, asssigned by callee. NULL indicates no response.
- * @param send_len  Pointer to response length, assigned by callee. Zero indicates no response.
+ * @return uint32_t Number of bytes consumed
+ */
+uint32_t comms_usb_hpt_receive_bytes(uint8_t *bytes, uint32_t nbytes);
+
+/**
+ * @brief Release the interrupt response in buf once it has been sent
+ * 
+ * @note Runs in USB interrupt
+ * 
+ * @param buf Buffer whose transmission completed
+ */
+void comms_usb_hpt_tx_done(uint8_t *buf);
+
+/**
+ * @brief Forget interrupt responses in flight, e.g. after the IN endpoint is reset
  */
-void comms_usb_hpt_receive_bytes(uint8_t *bytes, uint32_t nbytes, void **send_data, uint32_t *send_len);
+void comms_usb_hpt_tx_abort(void);
 
 /**
  * @brief Process communications tasks
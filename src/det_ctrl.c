@@ -11,6 +11,7 @@
 #include "det_driver_sw.h"
 #include "det_driver_qspi.h"
 #include "analog.h"
+#include "log.h"
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -33,6 +34,8 @@ static const uint8_t BitsSetTable65536[65536] = { B16(0) };
 
 #define POPCOUNT(x) __builtin_popcount(x)
 
+extern CRC_HandleTypeDef hcrc;
+
 uint32_t CountBitsInRange(uint16_t *data, uint32_t offset, uint32_t count)
 {
 	uint32_t bitcount = 0;
@@ -62,6 +65,14 @@ static void detDelay(uint32_t ticks)
 	while (ticks--) __asm__("");
 }
 
+static void detDelayUs(uint32_t us)
+{
+	uint32_t start = DWT->CYCCNT;
+	uint32_t cycles = us * (SystemCoreClock / 1000000);
+	while (DWT->CYCCNT - start < cycles)
+		;
+}
+
 void DetReset(void)
 {
 //	TP1_LOW;
@@ -146,12 +157,13 @@ int DetEnterVtMode(void)
 int DetSetVt(uint32_t vt_mv)
 {
 	gDetVtRequested = 1;
-	DacError dacerr = DAC_SUCCESS;
-	dacerr = SET_RESET_MV(vt_mv);
+	// no write and no wait if Vt is unchanged
+	uint32_t settle_us;
+	DacError dacerr = DacSetOutput(1, DAC1_COUNTS(vt_mv), &settle_us);
 	if (dacerr != DAC_SUCCESS)
 		return 1;
 
-	detDelay(10000);
+	detDelayUs(settle_us);
 	return 0;
 }
 
@@ -177,6 +189,62 @@ int DetExitVtMode(void)
 	return 0;
 }
 
+#define DET_ACC_MAX_MV	12500		// highest WP#/ACC the analog board drives
+
+static uint32_t detCfiBcdMv(uint16_t bcd)
+{
+	// bits 7-4 volts, bits 3-0 hundreds of mV
+	return ((bcd >> 4) & 0xF) * 1000 + (bcd & 0xF) * 100;
+}
+
+/**
+ * @brief WP#/ACC voltage for accelerated programming, from CFI
+ *
+ * @return uint32_t Middle of the CFI ACC supply range in mV, or 0 if ACC is not supported
+ */
+uint32_t DetAccVoltageMv(void)
+{
+	uint32_t min = detCfiBcdMv(gDetInfo.CfiExtQuery.AccSupplyMin);
+	uint32_t max = detCfiBcdMv(gDetInfo.CfiExtQuery.AccSupplyMax);
+	if (min == 0 || max < min)
+		return 0;
+	uint32_t mv = (min + max) / 2;
+	return mv > DET_ACC_MAX_MV ? DET_ACC_MAX_MV : mv;
+}
+
+/**
+ * @brief Raise WP#/ACC for accelerated programming
+ *
+ * Call with Vt mode exited. Always pair with DetExitAccMode, including
+ * when this fails.
+ *
+ * @return int 0 on success, 1 if ACC is not supported, 2 on DAC error
+ */
+int DetEnterAccMode(void)
+{
+	uint32_t mv = DetAccVoltageMv();
+	if (mv == 0)
+		return 1;
+
+	if (SET_WP_ACC_MV(mv) != DAC_SUCCESS)
+		return 2;
+
+	detDelay(10000);	// let WP#/ACC settle
+	return 0;
+}
+
+/**
+ * @brief Restore WP#/ACC to normal operation
+ *
+ * @return int 0 on success, 1 on DAC error
+ */
+int DetExitAccMode(void)
+{
+	if (WP_ACC_HIGH != DAC_SUCCESS)
+		return 1;
+	return 0;
+}
+
 void DetReadIdCfiData(S_DeviceInformation *detInfo, uint32_t SectorAddress)
 {
 //	uint32_t IdEntryAddrs[3] = { 0x555, 0x2AA, SectorAddress + 0x555 };
@@ -213,6 +281,43 @@ void DetReadIdCfiData(S_DeviceInformation *detInfo, uint32_t SectorAddress)
 	gDetApi->WriteCommandWord(0, 0xF0);
 }
 
+/**
+ * @brief Maximum time of an operation from its CFI timing fields
+ *
+ * CFI gives the typical time as 2^typ_log2 units and the maximum as
+ * 2^max_log2 times the typical time.
+ *
+ * @param typ_log2 Typical time field, e.g. gDetInfo.CfiInterface.TypTimeMaxMultiByteProgram
+ * @param max_log2 Maximum time field, e.g. gDetInfo.CfiInterface.MaxTimeBufferWrite
+ * @param fallback Returned if the fields are unsupported (0) or implausible
+ * @return Maximum time in the units of the field (us for programming, ms for erase)
+ */
+uint32_t DetCfiTimeout(uint16_t typ_log2, uint16_t max_log2, uint32_t fallback)
+{
+	if (typ_log2 == 0 || max_log2 == 0 || typ_log2 + max_log2 > 24)
+		return fallback;
+	return (1u << typ_log2) << max_log2;
+}
+
+// Used when CFI does not give a usable write buffer size
+#define DET_WRITE_BUFFER_DEFAULT_WORDS	32
+
+/**
+ * @brief Write buffer size from CFI
+ *
+ * CFI gives the buffer size as 2^n bytes; the detector is x16.
+ *
+ * @return uint32_t Size in words: a power of 2, at most DET_WRITE_BUFFER_MAX_WORDS
+ */
+static uint32_t detCfiWriteBufferWords(const S_DeviceInformation *detInfo)
+{
+	uint32_t n = (detInfo->CfiGeo.MaxBytesInMultiByteWrite_0 & 0xFF) | ((detInfo->CfiGeo.MaxBytesInMultiByteWrite_1 & 0xFF) << 8);
+	if (n == 0 || n > 16)
+		return DET_WRITE_BUFFER_DEFAULT_WORDS;
+	uint32_t words = 1u << (n - 1);
+	return words > DET_WRITE_BUFFER_MAX_WORDS ? DET_WRITE_BUFFER_MAX_WORDS : words;
+}
+
 void DetCtrlInit(void)
 {
 	//Manual_Open();
@@ -231,6 +336,8 @@ void DetCtrlInit(void)
 	detDelay(10000);
 
 	DetReadIdCfiData(&gDetInfo, 0);
+	gDetWriteBufferWords = detCfiWriteBufferWords(&gDetInfo);
+	LOG_INFO("[DetCtrlInit] Write buffer %lu words", gDetWriteBufferWords);
 
 	//DetReset();
 
@@ -288,27 +395,354 @@ void TaskDetCtrl(void)
 }
 */
 
-uint16_t mDataBlock[4096];	// 8K block = 4Kword = voltages for 256 words
+void DetReadData(uint32_t addr, uint16_t *data, uint32_t count)
+{
+	// The last 512-word chunk of each sector may read garbage when ReadBlock is used.
+	// Use ReadWords for addresses in [0xFE00, 0x10000) and ReadBlock otherwise.
+
+	uint32_t sector_offset = addr & 0xFFFF;
+
+	if (sector_offset + count < 0xFE00) {
+		gDetApi->ReadBlock(addr, count, data);
+	} else {
+		// Block 0 is addr up to the last 512-word chunk of the sector
+		// Block 1 is the last 512-word chunk of the sector
+		// Block 2 is the remaining data in the next sector
+		// Block 0 and Block 2 may be empty. Block 1 may be partial.
+		// Every block is limited by count, so no more than count words are written.
+		uint32_t block0_addr  = addr;
+		uint32_t block0_count = sector_offset < 0xFE00 ? 0xFE00 - sector_offset : 0;	// < count here
+		uint32_t block1_addr  = block0_addr + block0_count;	// >= sector + 0xFE00
+		uint32_t block1_count = 0x10000 - (block1_addr & 0xFFFF);
+		if (block1_count > count - block0_count)
+			block1_count = count - block0_count;
+		uint32_t block2_addr  = block1_addr + block1_count;	// = sector + 0x10000 if not empty
+		uint32_t block2_count = count - block0_count - block1_count;
+
+		if (block0_count > 0)
+			gDetApi->ReadBlock(block0_addr, block0_count, data);
+		for (uint32_t i = 0; i < block1_count; i++)
+			data[block0_count + i] = gDetApi->ReadWord(block1_addr + i);
+		if (block2_count > 0)
+			gDetApi->ReadBlock(block2_addr, block2_count, data + block0_count + block1_count);
+	}
+}
+
+// Streaming reads alternate between two chunk buffers: one is being filled
+// by DMA while the other is handed to the process stage.
+#define DET_STREAM_CHUNK_WORDS	2048
+
+uint16_t mDataBlock[2][DET_STREAM_CHUNK_WORDS] __attribute__((aligned(4)));	// 2 x 2Kword = 8 KB, MDMA reaches DTCM
+
+static uint32_t mReadPending;	// a ReadBlockStart has not been waited for
+
+/**
+ * @brief Start reading count words at addr into data
+ *
+ * Reads that touch the last 512-word chunk of a sector go through DetReadData
+ * and complete before this returns; others run by DMA until detReadWait.
+ */
+static void detReadStart(uint32_t addr, uint16_t *data, uint32_t count)
+{
+	if ((addr & 0xFFFF) + count < 0xFE00) {
+		gDetApi->ReadBlockStart(addr, count, data);
+		mReadPending = 1;
+	} else {
+		DetReadData(addr, data, count);
+	}
+}
+
+static void detReadWait(void)
+{
+	if (mReadPending) {
+		gDetApi->ReadBlockWait();
+		mReadPending = 0;
+	}
+}
+
+/**
+ * @brief Process stage of a streaming read
+ *
+ * @param offset Word offset of this chunk from the start of the stream
+ * @param data   Chunk data
+ * @param count  Number of words in chunk
+ * @param ctx    Caller context
+ */
+typedef void (*DetStreamFn)(uint32_t offset, uint16_t *data, uint32_t count, void *ctx);
+
+/**
+ * @brief Read count words starting at address in chunks, passing each chunk to process
+ *
+ * Chunks are a multiple of a page (8 words) except possibly the last.
+ */
+static void detStreamRead(uint32_t address, uint32_t count, DetStreamFn process, void *ctx)
+{
+	uint32_t buf    = 0;
+	uint32_t offset = 0;
+	uint32_t n      = count > DET_STREAM_CHUNK_WORDS ? DET_STREAM_CHUNK_WORDS : count;
+
+	if (n > 0 && !gDetAbort)
+		detReadStart(address, mDataBlock[buf], n);
+
+	while (n > 0) {
+		detReadWait();
+		// read stage: start the next chunk so it fills while this one is processed
+		uint32_t next   = offset + n;
+		uint32_t next_n = count - next > DET_STREAM_CHUNK_WORDS ? DET_STREAM_CHUNK_WORDS : count - next;
+		if (gDetAbort)
+			next_n = 0;
+		if (next_n > 0)
+			detReadStart(address + next, mDataBlock[buf ^ 1], next_n);
+		// process stage
+		process(offset, mDataBlock[buf], n, ctx);
+		offset = next;
+		n      = next_n;
+		buf   ^= 1;
+	}
+}
+
+static void detCountPagesChunk(uint32_t offset, uint16_t *data, uint32_t count, void *ctx)
+{
+	uint8_t *countBlock = (uint8_t *)ctx + offset/8;
+	for (uint32_t page=0; page<count/8; page++)
+		countBlock[page] = CountBitsInPage(data + 8*page);
+}
 
 void DetCmdCountBitsKPage(uint32_t address, uint8_t *countBlock)
 {
-	// read first half
-	gDetApi->ReadBlock(address, 512*8, mDataBlock);
-	// count first half
-	for (uint32_t page=0; page<512; page++)
-		countBlock[page] = CountBitsInPage(mDataBlock + 8*page);
+	// 1024 pages = 8K words
+	detStreamRead(address, 1024*8, detCountPagesChunk, countBlock);
+}
+
+// Used when the CFI erase time fields are zero
+#define DET_ERASE_SECTOR_TIMEOUT_MS		4000
+#define DET_ERASE_CHIP_TIMEOUT_MS		(1024 * DET_ERASE_SECTOR_TIMEOUT_MS)
+
+// Erase suspend timing. Standard CFI has no resume-to-suspend time, so it
+// is taken from the datasheet; the suspend latency falls back to it too.
+#define DET_ERASE_SUSPEND_TIMEOUT_US	35		// suspend latency, if CFI gives none
+#define DET_ERASE_RESUME_MIN_US			100		// erase time between resume and the next suspend
+#define DET_ERASE_RESUME_BUSY_US		10		// resume until the status shows the erase running
+
+#define DET_DQ6							0x0040	// toggles on every read while an erase runs
 
-	// read second half
-	gDetApi->ReadBlock(address + 512*8, 512*8, mDataBlock);
-	// count second half
-	for (uint32_t page=512; page<1024; page++)
-		countBlock[page] = CountBitsInPage(mDataBlock + 8*(page-512));
+// WaitDone takes us; saturate rather than wrap
+static uint32_t detMsToUs(uint32_t ms)
+{
+	return ms > 0xFFFFFFFF / 1000 ? 0xFFFFFFFF : ms * 1000;
 }
 
-void DetCmdProgramSector(uint32_t address, uint16_t word)
+// Suspendable erase in progress
+static uint32_t *mEraseAddrs;			// any address in each sector being erased
+static uint32_t mEraseCount;			// 0 when no suspendable erase is running
+static uint32_t mEraseSuspended;
+static uint32_t mEraseResumeCycles;		// DWT->CYCCNT at the last resume
+static DetError mEraseError;			// failure seen while suspending
+static uint32_t mEraseSuspendTick;		// HAL tick at the last suspend
+static uint32_t mEraseSuspendedMs;		// total time suspended, not counted towards the timeout
+
+/**
+ * @brief Whether a range is in a sector being erased
+ *
+ * Such sectors must not be read while the erase is suspended.
+ *
+ * @param address First word
+ * @param count   Number of words (0 is treated as 1)
+ */
+bool DetEraseTouches(uint32_t address, uint32_t count)
 {
-	//uint32_t usdelay = 2 << gDetInfo.CfiInterface.TypTimeSingleWordWrite;
-	gDetApi->ProgramBuffer_single(address, word, 65536);
+	uint32_t first = address / 0x10000;
+	uint32_t last  = (address + (count ? count - 1 : 0)) / 0x10000;
+	for (uint32_t i=0; i<mEraseCount; i++) {
+		uint32_t s = mEraseAddrs[i] / 0x10000;
+		if (s >= first && s <= last)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Suspend the erase in progress so other sectors can be read
+ *
+ * Waits until the minimum erase time since the last resume has passed, so
+ * repeated suspends cannot stall the erase, then for the suspend to take
+ * effect. The erase may finish instead, which is also fine.
+ *
+ * @note Only from a DetEraseIdleFn
+ *
+ * @return int 0 if suspended (or finished), 1 if suspend is unsupported or did not take effect
+ */
+int DetEraseSuspend(void)
+{
+	if (mEraseCount == 0 || mEraseSuspended || !gDetInfo.CfiExtQuery.EraseSuspend)
+		return 1;
+
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	while (DWT->CYCCNT - mEraseResumeCycles < DET_ERASE_RESUME_MIN_US * cycles_per_us)
+		;
+
+	uint32_t timeout_us = gDetInfo.CfiExtQuery.MaxEraseSuspendTimeout;
+	if (timeout_us == 0)
+		timeout_us = DET_ERASE_SUSPEND_TIMEOUT_US;
+
+	gDetApi->WriteCommandWord(mEraseAddrs[0], 0xB0);
+	mEraseSuspendTick = HAL_GetTick();
+	uint32_t start = DWT->CYCCNT;
+	DetError err;
+	while ((err = gDetApi->CheckDone(mEraseAddrs[0], 0xFFFF)) == DET_BUSY) {
+		if (DWT->CYCCNT - start >= timeout_us * cycles_per_us)
+			break;
+	}
+
+	mEraseSuspended = 1;
+	if (err != DET_OK) {
+		if (err == DET_ERR_FAILED)
+			mEraseError = err;		// device was reset: the erase wait reports it
+		DetEraseResume();
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Resume the erase suspended by DetEraseSuspend
+ *
+ * DQ7 reads as done while the erase is suspended, and may still do so just
+ * after the resume command, so this waits for DQ6 to toggle again before
+ * the next status check. DQ6 never toggles once the erase has finished
+ * (the resume is then ignored), so that wait is bounded.
+ */
+void DetEraseResume(void)
+{
+	if (!mEraseSuspended)
+		return;
+	gDetApi->WriteCommandWord(mEraseAddrs[0], 0x30);
+	mEraseResumeCycles = DWT->CYCCNT;
+
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	uint16_t prev = gDetApi->ReadWord(mEraseAddrs[0]);
+	while (DWT->CYCCNT - mEraseResumeCycles < DET_ERASE_RESUME_BUSY_US * cycles_per_us) {
+		uint16_t status = gDetApi->ReadWord(mEraseAddrs[0]);
+		if ((status ^ prev) & DET_DQ6)
+			break;
+		prev = status;
+	}
+
+	mEraseSuspendedMs += HAL_GetTick() - mEraseSuspendTick;
+	mEraseSuspended = 0;
+}
+
+/**
+ * @brief Wait for a sector erase, letting idle serve reads meanwhile
+ *
+ * Time spent suspended does not count towards the timeout.
+ */
+static DetError detEraseWait(uint32_t *addrs, uint32_t count, uint32_t timeout_ms, DetEraseIdleFn idle)
+{
+	mEraseAddrs = addrs;
+	mEraseCount = count;
+	mEraseResumeCycles = DWT->CYCCNT;
+	mEraseError = DET_OK;
+	mEraseSuspendedMs = 0;
+
+	uint32_t start = HAL_GetTick();
+	DetError err;
+	while ((err = gDetApi->CheckDone(addrs[0], 0xFFFF)) == DET_BUSY) {
+		if (HAL_GetTick() - start - mEraseSuspendedMs >= timeout_ms) {
+			// last check; resets the device if still busy
+			err = gDetApi->WaitDone(addrs[0], 0xFFFF, 0);
+			break;
+		}
+		if (idle) {
+			idle();
+			DetEraseResume();		// in case idle did not
+			if ((err = mEraseError) != DET_OK)
+				break;
+		}
+	}
+
+	mEraseCount = 0;
+	return err;
+}
+
+/**
+ * @brief Erase a sector and wait for it to finish
+ *
+ * @param address Any address in the sector
+ * @param idle    Called while the erase runs, or NULL
+ * @return DetError
+ */
+DetError DetCmdEraseSector(uint32_t address, DetEraseIdleFn idle)
+{
+	uint32_t timeout_ms = DetCfiTimeout(gDetInfo.CfiInterface.TypTimeBlockErase,
+										gDetInfo.CfiInterface.MaxTimeBlockErase, DET_ERASE_SECTOR_TIMEOUT_MS);
+	gDetApi->EraseSector(address);
+	DetError err = detEraseWait(&address, 1, timeout_ms, idle);
+	if (err != DET_OK)
+		LOG_ERROR("[DetCmdEraseSector] 0x%08lx failed: %lu", address, err);
+	return err;
+}
+
+/**
+ * @brief Erase the next batch of sectors from a set and wait for it to finish
+ *
+ * Sectors are erased together in one operation, up to DET_ERASE_BATCH_SECTORS
+ * at a time or as many as the device accepts. Call repeatedly until *next
+ * reaches 1024.
+ *
+ * @param sectors Bitmap of 1024 sectors, bit (i % 32) of word i / 32 for sector i
+ * @param next    In: first sector to consider. Out: first sector not yet erased
+ * @param idle    Called while the erase runs, or NULL
+ * @return DetError
+ */
+DetError DetCmdEraseSectors(const uint32_t *sectors, uint32_t *next, DetEraseIdleFn idle)
+{
+	uint32_t addrs[DET_ERASE_BATCH_SECTORS];
+	uint32_t count = 0;
+	uint32_t i;
+
+	for (i = *next; i < 1024 && count < DET_ERASE_BATCH_SECTORS; i++)
+		if (sectors[i / 32] & (1u << (i % 32)))
+			addrs[count++] = i * 0x10000;
+
+	if (count == 0) {
+		*next = 1024;
+		return DET_OK;
+	}
+
+	uint32_t accepted = gDetApi->EraseSectors(addrs, count);
+	*next = accepted < count ? addrs[accepted] / 0x10000 : i;
+
+	// sectors are erased one after another within the operation
+	uint32_t timeout_ms = DetCfiTimeout(gDetInfo.CfiInterface.TypTimeBlockErase,
+										gDetInfo.CfiInterface.MaxTimeBlockErase, DET_ERASE_SECTOR_TIMEOUT_MS);
+	DetError err = detEraseWait(addrs, accepted, timeout_ms * accepted, idle);
+	if (err != DET_OK)
+		LOG_ERROR("[DetCmdEraseSectors] batch at 0x%08lx (%lu sectors) failed: %lu", addrs[0], accepted, err);
+	return err;
+}
+
+/**
+ * @brief Erase the chip and wait for it to finish
+ *
+ * @note Cannot be cancelled or suspended: the device is busy until the erase completes
+ *
+ * @return DetError
+ */
+DetError DetCmdEraseChip(void)
+{
+	uint32_t timeout_ms = DetCfiTimeout(gDetInfo.CfiInterface.TypTimeChipErase,
+										gDetInfo.CfiInterface.MaxTimeChipErase, DET_ERASE_CHIP_TIMEOUT_MS);
+	gDetApi->EraseChip();
+	DetError err = gDetApi->WaitDone(0, 0xFFFF, detMsToUs(timeout_ms));
+	if (err != DET_OK)
+		LOG_ERROR("[DetCmdEraseChip] failed: %lu", err);
+	return err;
+}
+
+DetError DetCmdProgramSector(uint32_t address, uint16_t word)
+{
+	return gDetApi->ProgramBuffer_single(address, word, 65536);
 
 	/*
 	for (uint32_t i=0; i<2048; i++)
@@ -321,20 +755,323 @@ void DetCmdProgramSector(uint32_t address, uint16_t word)
 	*/
 }
 
-uint32_t DetCmdCountBitsSector(uint32_t address)
+static void detCountBitsChunk(uint32_t offset, uint16_t *data, uint32_t count, void *ctx)
+{
+	UNUSED(offset);
+	*(uint32_t *)ctx += CountBitsInRange(data, 0, count);
+}
+
+uint32_t DetCmdCountBitsRange(uint32_t address, uint32_t count)
 {
 	uint32_t ret = 0;
 
-	// For each 512 pages (1 sector = 16*512 pages):
-	//   Read 512 pages (4096 words)
-	//   Count bits
-	for (uint32_t i=0; i<16; i++)
-	{
-		gDetApi->ReadBlock(address + 512*8*i, 512*8, mDataBlock);
-		ret += CountBitsInRange(mDataBlock, 0, 512*8);
-	}
+	// counted chunk by chunk as it streams in
+	detStreamRead(address, count, detCountBitsChunk, &ret);
 
 	return ret;
 }
 
+uint32_t DetCmdCountBitsSector(uint32_t address)
+{
+	// 1 sector = 64K words
+	return DetCmdCountBitsRange(address, 0x10000);
+}
+
+/**
+ * @brief Read and run-length encode words until count words or the encoder output is full
+ *
+ * @return Number of words encoded
+ */
+uint32_t DetCmdReadRle(uint32_t address, uint32_t count, RleEncoder *enc)
+{
+	uint32_t buf    = 0;
+	uint32_t offset = 0;
+	uint32_t n      = count > DET_STREAM_CHUNK_WORDS ? DET_STREAM_CHUNK_WORDS : count;
+
+	// Not detStreamRead: reading stops as soon as the output fills
+	if (n > 0 && !gDetAbort)
+		detReadStart(address, mDataBlock[buf], n);
+
+	while (n > 0) {
+		detReadWait();
+		uint32_t next   = offset + n;
+		uint32_t next_n = count - next > DET_STREAM_CHUNK_WORDS ? DET_STREAM_CHUNK_WORDS : count - next;
+		if (gDetAbort)
+			next_n = 0;
+		if (next_n > 0)
+			detReadStart(address + next, mDataBlock[buf ^ 1], next_n);
+		uint32_t used = RleEncode(enc, mDataBlock[buf], n);
+		offset += used;
+		if (used < n) {
+			// output full: drop the chunk already in flight
+			detReadWait();
+			break;
+		}
+		n    = next_n;
+		buf ^= 1;
+	}
+
+	return offset;
+}
+
+/**
+ * @brief Time the byte-swap options on a block read
+ *
+ * Reads count words (capped at one stream chunk) through the driver's
+ * BenchSwap. Data near the end of a sector may be wrong, the timing is not.
+ *
+ * @return Number of words timed, 0 if the driver has no swap options
+ */
+uint32_t DetCmdBenchSwap(uint32_t address, uint32_t count, DetSwapBench *bench)
+{
+	*bench = (DetSwapBench){0};
+	if (!gDetApi->BenchSwap)
+		return 0;
+
+	if (count > DET_STREAM_CHUNK_WORDS)
+		count = DET_STREAM_CHUNK_WORDS;
+
+	gDetApi->BenchSwap(address, count, mDataBlock[0], bench);
+	return count;
+}
+
+/**
+ * @brief Time single-word reads and writes through the HAL and at register level
+ *
+ * Reads count words (capped at one stream chunk) each way through the
+ * driver's BenchWord. The writes are reset commands, so call with Vt mode
+ * exited.
+ *
+ * @return Number of words timed, 0 if the driver has no HAL path
+ */
+uint32_t DetCmdBenchOspi(uint32_t address, uint32_t count, DetOspiBench *bench)
+{
+	*bench = (DetOspiBench){0};
+	if (!gDetApi->BenchWord)
+		return 0;
+
+	if (count > DET_STREAM_CHUNK_WORDS)
+		count = DET_STREAM_CHUNK_WORDS;
+
+	gDetApi->BenchWord(address, count, mDataBlock[0], mDataBlock[1], bench);
+	return count;
+}
+
+static void detCrcChunk(uint32_t offset, uint16_t *data, uint32_t count, void *ctx)
+{
+	uint32_t *crc = ctx;
+	uint32_t words32 = count / 2;
+
+	// The CRC peripheral also checks USB messages in the USB interrupt, so it is only held
+	// for one chunk at a time. The running CRC is carried between chunks through INIT.
+	NVIC_DisableIRQ(OTG_HS_IRQn);
+	WRITE_REG(hcrc.Instance->INIT, *crc);
+	__HAL_CRC_DR_RESET(&hcrc);
+	if (words32)
+		HAL_CRC_Accumulate(&hcrc, (uint32_t *)data, words32);
+	if (count & 1) {
+		uint32_t last = data[count-1];
+		HAL_CRC_Accumulate(&hcrc, &last, 1);
+	}
+	*crc = READ_REG(hcrc.Instance->DR);
+	WRITE_REG(hcrc.Instance->INIT, hcrc.Init.InitValue);
+	NVIC_EnableIRQ(OTG_HS_IRQn);
+}
+
+/**
+ * @brief CRC of a range of words, read in the current mode
+ *
+ * Words are fed to the CRC peripheral in pairs (little-endian), with an odd last word zero-extended.
+ */
+uint32_t DetCmdCrcRange(uint32_t address, uint32_t count)
+{
+	uint32_t crc = hcrc.Init.InitValue;
+	detStreamRead(address, count, detCrcChunk, &crc);
+	return crc;
+}
 
+typedef struct {
+	uint32_t	Address;
+	det_pattern	Pattern;
+	uint16_t	Value;
+	DetFlip		*Flips;
+	uint32_t	MaxFlips;
+	uint32_t	TotalWords;
+	uint32_t	TotalBits;
+} DetFindFlipsCtx;
+
+static inline uint16_t detPatternWord(det_pattern pattern, uint16_t value, uint32_t addr)
+{
+	switch (pattern) {
+		case DET_PATTERN_ADDRESS:      return (uint16_t)addr;
+		case DET_PATTERN_CHECKERBOARD: return (addr & 1) ? (uint16_t)~value : value;
+		case DET_PATTERN_CONSTANT:
+		default:                       return value;
+	}
+}
+
+static inline void detRecordFlip(DetFindFlipsCtx *f, uint32_t addr, uint16_t mask)
+{
+	if (f->TotalWords < f->MaxFlips) {
+		f->Flips[f->TotalWords].Address = addr;
+		f->Flips[f->TotalWords].XorMask = mask;
+	}
+	f->TotalWords++;
+	f->TotalBits += POPCOUNT(mask);
+}
+
+static void detFindFlipsChunk(uint32_t offset, uint16_t *data, uint32_t count, void *ctx)
+{
+	DetFindFlipsCtx *f = ctx;
+	uint32_t addr = f->Address + offset;
+	uint32_t *data32 = (uint32_t *)data;
+
+	// Compare two words at a time. Upsets are rare, so almost every pair XORs to zero.
+	// Mismatching words are found with count-trailing-zeros on the 32-bit XOR.
+	for (uint32_t i=0; i<count/2; i++, addr+=2) {
+		uint32_t expected = detPatternWord(f->Pattern, f->Value, addr)
+		                  | (uint32_t)detPatternWord(f->Pattern, f->Value, addr + 1) << 16;
+		uint32_t x = data32[i] ^ expected;
+		while (x) {
+			uint32_t w = __builtin_ctz(x) / 16;
+			detRecordFlip(f, addr + w, (uint16_t)(x >> (16*w)));
+			x &= ~(0xFFFFu << (16*w));
+		}
+	}
+
+	// odd word at end of range
+	if (count & 1) {
+		uint16_t x = data[count-1] ^ detPatternWord(f->Pattern, f->Value, addr);
+		if (x)
+			detRecordFlip(f, addr, x);
+	}
+}
+
+void DetCmdFindFlips(uint32_t address, uint32_t count, det_pattern pattern, uint16_t value,
+                     DetFlip *flips, uint32_t maxFlips, uint32_t *totalWords, uint32_t *totalBits)
+{
+	DetFindFlipsCtx f = {
+		.Address    = address,
+		.Pattern    = pattern,
+		.Value      = value,
+		.Flips      = flips,
+		.MaxFlips   = maxFlips,
+		.TotalWords = 0,
+		.TotalBits  = 0
+	};
+
+	// DetReadData (via detStreamRead) handles the last 512-word chunk of each sector
+	detStreamRead(address, count, detFindFlipsChunk, &f);
+
+	*totalWords = f.TotalWords;
+	*totalBits  = f.TotalBits;
+}
+
+int DetCmdVtSweep(uint32_t address, uint32_t count, uint32_t start_mv, uint32_t step_mv, uint32_t points, uint32_t *bitCounts)
+{
+	if (DetEnterVtMode())
+		return 1;
+
+	for (uint32_t i=0; i<points && !gDetAbort; i++) {
+		if (DetSetVt(start_mv + i*step_mv))
+			return 1;
+		bitCounts[i] = DetCmdCountBitsRange(address, count);
+	}
+
+	return 0;
+}
+
+// Vt map working buffers
+static uint8_t  mVtMapHi[DET_VT_MAP_MAX_WORDS*16] AXI_BSS;	// per-cell upper bound of search interval
+static uint16_t mVtMapData[DET_VT_MAP_MAX_WORDS] AXI_BSS;
+
+/**
+ * @brief Find the Vt code of every cell in a word range by bisection
+ *
+ * Each cell searches for the first code c whose read voltage start_mv + c*step_mv
+ * reads it as 1. All cells advance one bisection level in lockstep, and a level
+ * reads the region once per distinct midpoint of the intervals still open.
+ *
+ * One read sets a single voltage for every cell, so cells on different codes
+ * cannot share it. Level L needs at most min(2^L, cells) reads: 8 in total
+ * when all Vts fall in one interval, but up to 255 (as many as a linear
+ * sweep) when they spread over every code. max_reads caps this. A level is
+ * only started if all its reads fit, so every cell is left at the same depth.
+ *
+ * @param address   First word
+ * @param count     Number of words, up to DET_VT_MAP_MAX_WORDS
+ * @param start_mv  Read voltage of code 0
+ * @param step_mv   Read voltage step per code
+ * @param max_reads Most region reads to spend, 0 for no limit
+ * @param codes     Out: per cell (word*16 + bit), the code or its lower bound
+ * @param reads     Out: region reads done
+ * @param levels    Out: levels completed. With 8 the codes are exact, otherwise
+ *                  each cell's code is within 256 >> levels codes above codes[]
+ * @return int 0 on success, 1 on a Vt mode or DAC error, 2 if count is too large
+ */
+int DetCmdVtMap(uint32_t address, uint32_t count, uint32_t start_mv, uint32_t step_mv, uint32_t max_reads,
+                uint8_t *codes, uint32_t *reads, uint32_t *levels)
+{
+	// codes[] holds the lower bound of each cell's interval and mVtMapHi the upper bound.
+	// the working buffers hold DET_VT_MAP_MAX_WORDS; DetReadData writes at most count words
+	if (count > DET_VT_MAP_MAX_WORDS)
+		return 2;
+	if (max_reads == 0)
+		max_reads = DET_VT_MAP_CODES;
+
+	uint32_t cells = count*16;
+	uint8_t *lo = codes;
+	uint8_t *hi = mVtMapHi;
+
+	*reads  = 0;
+	*levels = 0;
+	for (uint32_t c=0; c<cells; c++) {
+		lo[c] = 0;
+		hi[c] = DET_VT_MAP_CODES;
+	}
+
+	if (DetEnterVtMode())
+		return 1;
+
+	for (uint32_t level=0; level<8 && !gDetAbort; level++) {
+		// set of midpoints needed at this level
+		uint32_t needed[(DET_VT_MAP_CODES + 31)/32] = { 0 };
+		for (uint32_t c=0; c<cells; c++) {
+			if (lo[c] < hi[c]) {
+				uint32_t mid = (lo[c] + hi[c]) / 2;
+				needed[mid/32] |= 1u << (mid%32);
+			}
+		}
+
+		uint32_t level_reads = 0;
+		for (uint32_t n=0; n<sizeof(needed)/sizeof(needed[0]); n++)
+			level_reads += __builtin_popcount(needed[n]);
+		if (*reads + level_reads > max_reads)
+			break;
+
+		for (uint32_t n=0; n<sizeof(needed)/sizeof(needed[0]); n++) {
+			while (needed[n]) {
+				uint32_t mid = 32*n + __builtin_ctz(needed[n]);
+				needed[n] &= needed[n] - 1;
+
+				if (DetSetVt(start_mv + mid*step_mv))
+					return 1;
+				DetReadData(address, mVtMapData, count);
+				(*reads)++;
+
+				for (uint32_t c=0; c<cells; c++) {
+					if (lo[c] < hi[c] && (uint32_t)(lo[c] + hi[c]) / 2 == mid) {
+						if ((mVtMapData[c/16] >> (c%16)) & 0x1)
+							hi[c] = mid;
+						else
+							lo[c] = mid + 1;
+					}
+				}
+			}
+		}
+		if (!gDetAbort)
+			(*levels)++;
+	}
+
+	return 0;
+}
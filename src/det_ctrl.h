@@ -18,9 +18,12 @@ extern "C" {
 #endif /* DET_CTRL_C */
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "rle.h"
 
 // configuration
 #define DET_IS_IN_MODE_BYTE
+//#define DET_QSPI_MEMORY_MAPPED		///< read through the OSPI memory-mapped window instead of indirect MDMA reads
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -45,6 +48,9 @@ extern void DetReset(void);
 extern int DetEnterVtMode(void);
 extern int DetSetVt(uint32_t vt_mv);
 extern int DetExitVtMode(void);
+extern uint32_t DetAccVoltageMv(void);
+extern int DetEnterAccMode(void);
+extern int DetExitAccMode(void);
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -54,6 +60,38 @@ extern int DetExitVtMode(void);
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Result of an embedded program or erase operation
+ */
+typedef enum {
+	DET_OK = 0,
+	DET_ERR_TIMEOUT,		///< DQ7 did not show completion within the CFI maximum time
+	DET_ERR_FAILED,			///< the device set DQ5 (exceeded its internal time limit)
+	DET_BUSY				///< still running (CheckDone only, not an error)
+} DetError;
+
+/**
+ * CPU cycles for each way of byte-swapping a block read
+ */
+typedef struct {
+	uint32_t	Scalar;			///< swap only, one half-word at a time
+	uint32_t	Rev16;			///< swap only, REV16 on two half-words at a time
+	uint32_t	ReadMdma;		///< ReadBlock, swapped by MDMA
+	uint32_t	ReadRev16;		///< ReadBlock, then REV16 swap
+	uint32_t	ReadScalar;		///< ReadBlock, then scalar swap
+} DetSwapBench;
+
+/**
+ * CPU cycles for single-word accesses through the HAL and at register level
+ */
+typedef struct {
+	uint32_t	ReadHal;		///< ReadWord through HAL_OSPI_Command/Receive
+	uint32_t	ReadFast;		///< register-level ReadWord
+	uint32_t	WriteHal;		///< WriteWord through HAL_OSPI_Command/Transmit
+	uint32_t	WriteFast;		///< register-level WriteWord
+	uint32_t	Mismatches;		///< words read differently by the two paths
+} DetOspiBench;
+
 typedef struct
 {
 	void (*Open)(void);
@@ -62,6 +100,8 @@ typedef struct
 	uint16_t	(*ReadWord)(uint32_t addr);
 	void		(*ReadWords)(uint32_t *addrs, uint16_t *dest, uint32_t count);
 	void 		(*ReadBlock)(uint32_t base, uint32_t count, uint16_t *dest);
+	void 		(*ReadBlockStart)(uint32_t base, uint32_t count, uint16_t *dest);	// asynchronous ReadBlock
+	void 		(*ReadBlockWait)(void);												// wait for ReadBlockStart; dest is valid after
 	void		(*ReadPage)(uint32_t PageAddress, uint16_t *dest);
 	void		(*WriteWord)(uint32_t addr, uint16_t word);
 	void		(*WriteWords)(uint32_t *addrs, uint16_t *words, uint32_t count);
@@ -69,10 +109,17 @@ typedef struct
 	void		(*WriteCommandWords)(uint32_t *addrs, uint16_t *words, uint32_t count);
 	void		(*WriteBlock)(uint32_t base, uint32_t count, uint16_t *block);
 	void        (*ProgramWord)(uint32_t address, uint16_t word);
-	void		(*ProgramBuffer)(uint32_t SectorAddress, uint16_t *data, uint32_t count);
-	void		(*ProgramBuffer_single)(uint32_t SectorAddress, uint16_t word, uint32_t count);
+	DetError	(*ProgramBuffer)(uint32_t SectorAddress, uint16_t *data, uint32_t count);
+	DetError	(*ProgramBuffer_single)(uint32_t SectorAddress, uint16_t word, uint32_t count);
+	void		(*UnlockBypassEnter)(void);		///< Shorten program commands until UnlockBypassExit; no-op if unsupported
+	void		(*UnlockBypassExit)(void);
 	void		(*EraseSector)(uint32_t SectorAddress);
 	void		(*EraseChip)(void);
+	uint32_t	(*EraseSectors)(uint32_t *addrs, uint32_t count);	///< Start a multi-sector erase, returns sectors accepted
+	DetError	(*WaitDone)(uint32_t addr, uint16_t expected, uint32_t timeout_us);	///< Wait for an embedded operation to finish
+	DetError	(*CheckDone)(uint32_t addr, uint16_t expected);	///< Check once, DET_BUSY if still running
+	void		(*BenchSwap)(uint32_t base, uint32_t count, uint16_t *dest, DetSwapBench *bench);	///< Time the byte-swap options, or NULL
+	void		(*BenchWord)(uint32_t addr, uint32_t count, uint16_t *hal, uint16_t *fast, DetOspiBench *bench);	///< Time HAL and register-level word access, or NULL
 
 	void        (*EnterVt)(void);
 	void        (*ExitVt)(void);
@@ -190,8 +237,12 @@ typedef struct
 EXTERN S_DeviceInformation	gDetInfo;
 
 EXTERN uint32_t				gDetIsBusy;
+#define DET_WRITE_BUFFER_MAX_WORDS	256		///< Largest write buffer the driver programs with
+EXTERN uint32_t				gDetWriteBufferWords;	///< Write buffer size in words, from CFI
+EXTERN volatile uint32_t	gDetAbort;				///< Set to stop a long operation at the next chunk
 
 extern void DetCtrlInit(void);
+extern uint32_t DetCfiTimeout(uint16_t typ_log2, uint16_t max_log2, uint32_t fallback);
 extern void TaskDetCtrl(void);
 
 //////////////////////////////////////////////////////////////////////////////
@@ -202,9 +253,48 @@ extern void TaskDetCtrl(void);
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
-extern void DetCmdProgramSector(uint32_t address, uint16_t word);
+extern void DetReadData(uint32_t addr, uint16_t *data, uint32_t count);
+extern DetError DetCmdProgramSector(uint32_t address, uint16_t word);
+/**
+ * Called repeatedly while a sector erase runs. May call DetEraseSuspend,
+ * read sectors for which DetEraseTouches is false, then DetEraseResume.
+ */
+typedef void (*DetEraseIdleFn)(void);
+extern DetError DetCmdEraseSector(uint32_t address, DetEraseIdleFn idle);
+extern DetError DetCmdEraseChip(void);
+#define DET_ERASE_BATCH_SECTORS	64		///< Max sectors per erase operation in DetCmdEraseSectors
+extern DetError DetCmdEraseSectors(const uint32_t *sectors, uint32_t *next, DetEraseIdleFn idle);
+extern bool DetEraseTouches(uint32_t address, uint32_t count);
+extern int DetEraseSuspend(void);
+extern void DetEraseResume(void);
+extern uint32_t DetCmdCountBitsRange(uint32_t address, uint32_t count);
 extern uint32_t DetCmdCountBitsSector(uint32_t address);
+#define DET_VT_MAP_MAX_WORDS	256		///< Max words mapped by DetCmdVtMap
+#define DET_VT_MAP_CODES		255		///< Vt codes searched by DetCmdVtMap; a code of DET_VT_MAP_CODES means never read as 1
+
+extern int DetCmdVtMap(uint32_t address, uint32_t count, uint32_t start_mv, uint32_t step_mv, uint32_t max_reads,
+                       uint8_t *codes, uint32_t *reads, uint32_t *levels);
+typedef enum {
+	DET_PATTERN_CONSTANT,		///< every word is the value
+	DET_PATTERN_ADDRESS,		///< every word is the low 16 bits of its address
+	DET_PATTERN_CHECKERBOARD	///< value at even addresses, ~value at odd addresses
+} det_pattern;
+
+typedef struct {
+	uint32_t	Address;
+	uint16_t	XorMask;
+} DetFlip;
+
+extern uint32_t DetCmdReadRle(uint32_t address, uint32_t count, RleEncoder *enc);
+extern uint32_t DetCmdCrcRange(uint32_t address, uint32_t count);
+extern void DetCmdFindFlips(uint32_t address, uint32_t count, det_pattern pattern, uint16_t value,
+                            DetFlip *flips, uint32_t maxFlips, uint32_t *totalWords, uint32_t *totalBits);
+extern int DetCmdVtSweep(uint32_t address, uint32_t count, uint32_t start_mv, uint32_t step_mv, uint32_t points, uint32_t *bitCounts);
 extern void DetCmdCountBitsKPage(uint32_t address, uint8_t *countBlock);
+
+extern uint32_t DetCmdBenchSwap(uint32_t address, uint32_t count, DetSwapBench *bench);
+
+extern uint32_t DetCmdBenchOspi(uint32_t address, uint32_t count, DetOspiBench *bench);
 extern void DetCmdVtReadVoltageBlock(void);
 
 #if defined(__cplusplus)
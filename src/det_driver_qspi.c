@@ -9,9 +9,135 @@
 
 extern OSPI_HandleTypeDef hospi1;
 
-static void qspi_delay(uint32_t ticks)
+extern MDMA_HandleTypeDef hmdma_octospi1_fifo_th;
+
+// OSPI shifts little-endian but the detector is big-endian
+static inline uint16_t qspi_swap16(uint16_t w)
+{
+	return (uint16_t)__REV16(w);
+}
+
+static det_swap mSwapMode = DET_SWAP_MDMA;
+
+// Register-level word reads (0x0B) and writes (0xF8). Both use 4-line
+// instruction, 32-bit address and 4-line data, SDR, no DQS; they differ
+// only in dummy cycles. Skips building an OSPI_RegularCmdTypeDef and the
+// HAL state machine on every word.
+#define QSPI_CCR_WORD	(HAL_OSPI_INSTRUCTION_4_LINES | HAL_OSPI_INSTRUCTION_8_BITS | \
+						 HAL_OSPI_ADDRESS_4_LINES | HAL_OSPI_ADDRESS_32_BITS | HAL_OSPI_DATA_4_LINES)
+static uint32_t mTcrRead;		// TCR with 20 dummy cycles, set in QSPI_Open
+static uint32_t mTcrWrite;		// TCR with no dummy cycles
+
+#ifdef DET_QSPI_MEMORY_MAPPED
+// Memory-mapped reads: the OSPI issues the 0x0B read itself on each AHB access.
+// The OSPI sends the AHB byte offset as the address but the detector takes it
+// as a word address and the data stream advances two bytes per word, so a
+// window offset is only meaningful as the first access of a fresh read. Every
+// read therefore aborts the previous stream, then reads sequentially.
+static uint32_t mMapped;
+
+static void qspi_read_cmd_init(OSPI_RegularCmdTypeDef *cmd, uint32_t addr, uint32_t count);
+
+/**
+ * @brief Leave memory-mapped mode before an indirect command
+ */
+static void qspi_indirect(void)
+{
+	if (mMapped) {
+		if (HAL_OSPI_Abort(&hospi1) != HAL_OK) Error_Handler();
+		mMapped = 0;
+	}
+}
+
+/**
+ * @brief Enter memory-mapped mode, or restart the read stream if already in it
+ */
+static void qspi_mapped(void)
+{
+	if (mMapped) {
+		// stop the prefetch so the next access starts a new read at its own address
+		SET_BIT(hospi1.Instance->CR, OCTOSPI_CR_ABORT);
+		while (READ_BIT(hospi1.Instance->CR, OCTOSPI_CR_ABORT)) ;
+		MODIFY_REG(hospi1.Instance->CR, OCTOSPI_CR_FMODE, OCTOSPI_CR_FMODE);
+		return;
+	}
+
+	OSPI_RegularCmdTypeDef cmd;
+	OSPI_MemoryMappedTypeDef cfg = {
+		.TimeOutActivation     = HAL_OSPI_TIMEOUT_COUNTER_DISABLE,
+		.TimeOutPeriod         = 0
+	};
+	qspi_read_cmd_init(&cmd, 0, 1);
+	if (HAL_OSPI_Command(&hospi1, &cmd, HAL_MAX_DELAY) != HAL_OK) Error_Handler();
+	if (HAL_OSPI_MemoryMapped(&hospi1, &cfg) != HAL_OK) Error_Handler();
+	mMapped = 1;
+}
+
+// The window is 256 MB and its byte offset is the word address, so higher
+// addresses (the config flash at 0x80000000, for one) are read indirectly.
+#define QSPI_MAPPED_WINDOW	0x10000000
+
+/**
+ * @brief Whether count words at addr can be read through the window
+ */
+static bool qspi_mapped_reaches(uint32_t addr, uint32_t count)
+{
+	return addr < QSPI_MAPPED_WINDOW && count <= (QSPI_MAPPED_WINDOW - addr) / 2;
+}
+
+/**
+ * @brief Read count words at addr through the memory-mapped window
+ *
+ * The window is Device memory (see MPU_Config), so accesses are aligned:
+ * half-words from an even address, bytes from an odd one.
+ *
+ * @note Only where qspi_mapped_reaches
+ */
+static void qspi_mapped_read(uint32_t addr, uint32_t count, uint16_t *dest)
 {
-	while (ticks--) __asm__("");
+	qspi_mapped();
+	if ((addr & 1) == 0) {
+		volatile uint16_t *src = (volatile uint16_t *)(OCTOSPI1_BASE + addr);
+		for (uint32_t i=0; i<count; i++)
+			dest[i] = qspi_swap16(src[i]);
+	} else {
+		// first byte on the bus is the high byte
+		volatile uint8_t *src = (volatile uint8_t *)(OCTOSPI1_BASE + addr);
+		for (uint32_t i=0; i<count; i++)
+			dest[i] = (src[2*i] << 8) | src[2*i + 1];
+	}
+}
+#else
+static inline void qspi_indirect(void) {}
+#endif
+
+/**
+ * @brief Fill in the 0x0B read command, 20 dummy cycles
+ */
+static void qspi_read_cmd_init(OSPI_RegularCmdTypeDef *cmd, uint32_t addr, uint32_t count)
+{
+	*cmd = (OSPI_RegularCmdTypeDef){
+		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
+		.FlashId               = HAL_OSPI_FLASH_ID_1,
+		.Instruction           = 0x0B,
+		.InstructionMode       = HAL_OSPI_INSTRUCTION_4_LINES,
+		.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS,
+		.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE,
+		.Address               = addr,
+		.AddressMode           = HAL_OSPI_ADDRESS_4_LINES,
+		.AddressSize           = HAL_OSPI_ADDRESS_32_BITS,
+		.AddressDtrMode        = HAL_OSPI_ADDRESS_DTR_DISABLE,
+		.AlternateBytes        = 0,
+		.AlternateBytesMode    = HAL_OSPI_ALTERNATE_BYTES_NONE,
+		.AlternateBytesSize    = HAL_OSPI_ALTERNATE_BYTES_8_BITS,
+		.AlternateBytesDtrMode = HAL_OSPI_ALTERNATE_BYTES_DTR_DISABLE,
+		.DataMode              = HAL_OSPI_DATA_4_LINES,
+		.NbData                = 2*count,
+		.DataDtrMode           = HAL_OSPI_DATA_DTR_DISABLE,
+		.DummyCycles           = 20,
+		.DQSMode               = HAL_OSPI_DQS_DISABLE,
+		.SIOOMode              = HAL_OSPI_SIOO_INST_EVERY_CMD
+	};
 }
 
 S_DetApi gQSPIDriver = {
@@ -21,6 +147,8 @@ S_DetApi gQSPIDriver = {
 	.ReadWord				= QSPI_ReadWord,
 	.ReadWords				= QSPI_ReadWords,
 	.ReadBlock				= QSPI_ReadBlock,
+	.ReadBlockStart			= QSPI_ReadBlockStart,
+	.ReadBlockWait			= QSPI_ReadBlockWait,
 	.ReadPage				= QSPI_ReadPage,
 	.WriteWord				= QSPI_WriteWord,
 	.WriteWords				= QSPI_WriteWords,
@@ -30,8 +158,15 @@ S_DetApi gQSPIDriver = {
 	.ProgramWord            = QSPI_ProgramWord,
 	.ProgramBuffer			= QSPI_ProgramBuffer,
 	.ProgramBuffer_single	= QSPI_ProgramBuffer_single,
+	.UnlockBypassEnter		= QSPI_UnlockBypassEnter,
+	.UnlockBypassExit		= QSPI_UnlockBypassExit,
 	.EraseSector			= QSPI_EraseSector,
 	.EraseChip				= QSPI_EraseChip,
+	.EraseSectors			= QSPI_EraseSectors,
+	.WaitDone				= QSPI_PollDQ7,
+	.CheckDone				= QSPI_CheckDQ7,
+	.BenchSwap				= QSPI_BenchSwap,
+	.BenchWord				= QSPI_BenchWord,
 	.EnterVt                = QSPI_EnterVt,
 	.ExitVt                 = QSPI_ExitVt,
 	.EnterCfgFlash          = QSPI_EnterCfgFlash,
@@ -42,6 +177,10 @@ void QSPI_Open(void)
 {
 	gDetApi = &gQSPIDriver;
 
+	// TCR also holds the sample shift and hold settings from HAL_OSPI_Init
+	mTcrRead  = (hospi1.Instance->TCR & ~OCTOSPI_TCR_DCYC) | 20;
+	mTcrWrite = (hospi1.Instance->TCR & ~OCTOSPI_TCR_DCYC);
+
 	CE_SWITCH_DIG;
 }
 
@@ -50,30 +189,16 @@ void QSPI_Close(void)
 	// do nothing
 }
 
-uint16_t QSPI_ReadWord(uint32_t addr)
+/**
+ * @brief Read one word through the HAL
+ *
+ * Kept for comparison with the register-level QSPI_ReadWord.
+ */
+uint16_t QSPI_ReadWordHal(uint32_t addr)
 {
-	OSPI_RegularCmdTypeDef cmd = {
-		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
-		.FlashId               = HAL_OSPI_FLASH_ID_1,
-		.Instruction           = 0x0B,
-		.InstructionMode       = HAL_OSPI_INSTRUCTION_4_LINES,
-		.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS,
-		.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE,
-		.Address               = addr,
-		.AddressMode           = HAL_OSPI_ADDRESS_4_LINES,
-		.AddressSize           = HAL_OSPI_ADDRESS_32_BITS,
-		.AddressDtrMode        = HAL_OSPI_ADDRESS_DTR_DISABLE,
-		.AlternateBytes        = 0,
-		.AlternateBytesMode    = HAL_OSPI_ALTERNATE_BYTES_NONE,
-		.AlternateBytesSize    = HAL_OSPI_ALTERNATE_BYTES_8_BITS,
-		.AlternateBytesDtrMode = HAL_OSPI_ALTERNATE_BYTES_DTR_DISABLE,
-		.DataMode              = HAL_OSPI_DATA_4_LINES,
-		.NbData                = 2,
-		.DataDtrMode           = HAL_OSPI_DATA_DTR_DISABLE,
-		.DummyCycles           = 20,
-		.DQSMode               = HAL_OSPI_DQS_DISABLE,
-		.SIOOMode              = HAL_OSPI_SIOO_INST_EVERY_CMD
-	};
+	qspi_indirect();
+	OSPI_RegularCmdTypeDef cmd;
+	qspi_read_cmd_init(&cmd, addr, 1);
 	/*OSPI_RegularCmdTypeDef cmd = {
 		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
 		.FlashId               = HAL_OSPI_FLASH_ID_1,
@@ -105,9 +230,34 @@ uint16_t QSPI_ReadWord(uint32_t addr)
 	status = HAL_OSPI_Receive(&hospi1, (uint8_t*)&data, HAL_MAX_DELAY);
 	while (HAL_OSPI_GetState(&hospi1) != HAL_OSPI_STATE_READY) ;
 	if (status != HAL_OK) Error_Handler();
-	// OSPI shifts in little-endian but we need big-endian
-	data = ((data & 0x00FF) << 8) | ((data & 0xFF00) >> 8);
-	return data;
+	return qspi_swap16(data);
+}
+
+uint16_t QSPI_ReadWord(uint32_t addr)
+{
+#ifdef DET_QSPI_MEMORY_MAPPED
+	if (qspi_mapped_reaches(addr, 1)) {
+		uint16_t word;
+		qspi_mapped_read(addr, 1, &word);
+		return word;
+	}
+	qspi_indirect();
+#endif
+	OCTOSPI_TypeDef *ospi = hospi1.Instance;
+
+	while (ospi->SR & OCTOSPI_SR_BUSY) ;
+	MODIFY_REG(ospi->CR, OCTOSPI_CR_FMODE, OCTOSPI_CR_FMODE_0);	// indirect read
+	ospi->DLR = 2 - 1;
+	ospi->CCR = QSPI_CCR_WORD;
+	ospi->TCR = mTcrRead;
+	ospi->IR  = 0x0B;
+	ospi->AR  = addr;	// starts the read
+
+	while (!(ospi->SR & (OCTOSPI_SR_TCF | OCTOSPI_SR_TEF))) ;
+	if (ospi->SR & OCTOSPI_SR_TEF) Error_Handler();
+	uint16_t data = *(__IO uint16_t *)&ospi->DR;
+	ospi->FCR = OCTOSPI_FCR_CTCF;
+	return qspi_swap16(data);
 }
 
 void QSPI_ReadWords(uint32_t *addrs, uint16_t *dest, uint32_t count)
@@ -117,46 +267,146 @@ void QSPI_ReadWords(uint32_t *addrs, uint16_t *dest, uint32_t count)
 	}
 }
 
-void QSPI_ReadBlock(uint32_t base, uint32_t count, uint16_t *dest)
+/**
+ * @brief Swap the bytes of count half-words, one at a time
+ */
+void QSPI_Swap16Scalar(uint16_t *data, uint32_t count)
 {
-	//for (uint32_t i=0; i<count; i++)
-	//	dest[i] = QSPI_ReadWord(base + i);
-	
-	OSPI_RegularCmdTypeDef cmd = {
-		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
-		.FlashId               = HAL_OSPI_FLASH_ID_1,
-		.Instruction           = 0x0B,
-		.InstructionMode       = HAL_OSPI_INSTRUCTION_4_LINES,
-		.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS,
-		.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE,
-		.Address               = base,
-		.AddressMode           = HAL_OSPI_ADDRESS_4_LINES,
-		.AddressSize           = HAL_OSPI_ADDRESS_32_BITS,
-		.AddressDtrMode        = HAL_OSPI_ADDRESS_DTR_DISABLE,
-		.AlternateBytes        = 0,
-		.AlternateBytesMode    = HAL_OSPI_ALTERNATE_BYTES_NONE,
-		.AlternateBytesSize    = HAL_OSPI_ALTERNATE_BYTES_8_BITS,
-		.AlternateBytesDtrMode = HAL_OSPI_ALTERNATE_BYTES_DTR_DISABLE,
-		.DataMode              = HAL_OSPI_DATA_4_LINES,
-		.NbData                = 2*count,
-		.DataDtrMode           = HAL_OSPI_DATA_DTR_DISABLE,
-		.DummyCycles           = 20,
-		.DQSMode               = HAL_OSPI_DQS_DISABLE,
-		.SIOOMode              = HAL_OSPI_SIOO_INST_EVERY_CMD
-	};
+	for (uint32_t i=0; i<count; i++)
+		data[i] = ((data[i] & 0x00FF) << 8) | ((data[i] & 0xFF00) >> 8);
+}
+
+/**
+ * @brief Swap the bytes of count half-words, two at a time with REV16
+ */
+void QSPI_Swap16Rev16(uint16_t *data, uint32_t count)
+{
+	if (((uintptr_t)data & 2) && count) {
+		*data = qspi_swap16(*data);
+		data++;
+		count--;
+	}
+
+	uint32_t *data32 = (uint32_t *)data;
+	for (uint32_t i=0; i<count/2; i++)
+		data32[i] = __REV16(data32[i]);
+
+	if (count & 1)
+		data[count-1] = qspi_swap16(data[count-1]);
+}
+
+/**
+ * @brief Select where block reads are byte-swapped
+ *
+ * DET_SWAP_MDMA (default) swaps in the MDMA during the transfer at no CPU
+ * cost. The others swap in QSPI_ReadBlockWait and are kept for comparison.
+ */
+void QSPI_SetSwapMode(det_swap mode)
+{
+	mSwapMode = mode;
+}
+
+// Asynchronous block read in flight, byte-swapped when it completes
+static uint16_t *mReadDest;
+static uint32_t  mReadCount;
+
+/**
+ * @brief Start reading count words from base into dest by DMA (MDMA)
+ *
+ * dest must be half-word aligned: the MDMA moves half-words.
+ *
+ * Returns once the transfer is started. Call QSPI_ReadBlockWait before
+ * using dest or starting another OSPI access.
+ */
+void QSPI_ReadBlockStart(uint32_t base, uint32_t count, uint16_t *dest)
+{
+#ifdef DET_QSPI_MEMORY_MAPPED
+	if (qspi_mapped_reaches(base, count)) {
+		// complete on return; QSPI_ReadBlockWait has nothing to wait for
+		qspi_mapped_read(base, count, dest);
+		return;
+	}
+	qspi_indirect();
+#endif
+	OSPI_RegularCmdTypeDef cmd;
+	qspi_read_cmd_init(&cmd, base, count);
 
 	HAL_StatusTypeDef status;
 	status = HAL_OSPI_Command(&hospi1, &cmd, HAL_MAX_DELAY);
 	if (status != HAL_OK) Error_Handler();
 
-	status = HAL_OSPI_Receive(&hospi1, (uint8_t*)dest, HAL_MAX_DELAY);
-	while (HAL_OSPI_GetState(&hospi1) != HAL_OSPI_STATE_READY) ;
+	mReadDest  = dest;
+	mReadCount = count;
+	// MDMA channel is idle here: the byte exchange takes effect on this transfer
+	MODIFY_REG(hmdma_octospi1_fifo_th.Instance->CCR, MDMA_CCR_BEX,
+	           mSwapMode == DET_SWAP_MDMA ? MDMA_LITTLE_BYTE_ENDIANNESS_EXCHANGE : MDMA_LITTLE_ENDIANNESS_PRESERVE);
+	// completes in the OCTOSPI1 interrupt (transfer complete after the MDMA drains the FIFO)
+	status = HAL_OSPI_Receive_DMA(&hospi1, (uint8_t*)dest);
 	if (status != HAL_OK) Error_Handler();
-	// OSPI shifts in little-endian but we need big-endian
-	for (uint32_t i=0; i<count; i++)
-		dest[i] = ((dest[i] & 0x00FF) << 8) | ((dest[i] & 0xFF00) >> 8);
-	//data = ((data & 0x00FF) << 8) | ((data & 0xFF00) >> 8);
-	//return data;
+}
+
+/**
+ * @brief Wait for the read started by QSPI_ReadBlockStart
+ */
+void QSPI_ReadBlockWait(void)
+{
+	if (mReadCount == 0)
+		return;
+
+	while (HAL_OSPI_GetState(&hospi1) != HAL_OSPI_STATE_READY) ;
+	if (hospi1.ErrorCode != HAL_OSPI_ERROR_NONE) Error_Handler();
+
+	if (mSwapMode == DET_SWAP_REV16)
+		QSPI_Swap16Rev16(mReadDest, mReadCount);
+	else if (mSwapMode == DET_SWAP_SCALAR)
+		QSPI_Swap16Scalar(mReadDest, mReadCount);
+	mReadCount = 0;
+}
+
+void QSPI_ReadBlock(uint32_t base, uint32_t count, uint16_t *dest)
+{
+	QSPI_ReadBlockStart(base, count, dest);
+	QSPI_ReadBlockWait();
+}
+
+/**
+ * @brief Time the byte-swap options on a block read
+ *
+ * Reads with QSPI_ReadBlock, bypassing the end-of-sector workaround, so data
+ * in that zone may be wrong but the timing is not. The MDMA swap mode is
+ * restored before returning.
+ *
+ * @param base  First word
+ * @param count Number of words, at most the size of dest
+ * @param dest  Scratch buffer, holds the last read
+ * @param bench Cycle counts
+ */
+void QSPI_BenchSwap(uint32_t base, uint32_t count, uint16_t *dest, DetSwapBench *bench)
+{
+	uint32_t start;
+
+	start = DWT->CYCCNT;
+	QSPI_Swap16Scalar(dest, count);
+	bench->Scalar = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	QSPI_Swap16Rev16(dest, count);
+	bench->Rev16 = DWT->CYCCNT - start;
+
+	QSPI_SetSwapMode(DET_SWAP_SCALAR);
+	start = DWT->CYCCNT;
+	QSPI_ReadBlock(base, count, dest);
+	bench->ReadScalar = DWT->CYCCNT - start;
+
+	QSPI_SetSwapMode(DET_SWAP_REV16);
+	start = DWT->CYCCNT;
+	QSPI_ReadBlock(base, count, dest);
+	bench->ReadRev16 = DWT->CYCCNT - start;
+
+	QSPI_SetSwapMode(DET_SWAP_MDMA);
+	start = DWT->CYCCNT;
+	QSPI_ReadBlock(base, count, dest);
+	bench->ReadMdma = DWT->CYCCNT - start;
 }
 
 void QSPI_ReadPage(uint32_t PageAddress, uint16_t *dest)
@@ -164,9 +414,34 @@ void QSPI_ReadPage(uint32_t PageAddress, uint16_t *dest)
 	QSPI_ReadBlock(PageAddress, 8, dest);
 }
 
-void QSPI_WriteWord(uint32_t addr, uint16_t word) {
-	// OSPI shifts out little-endian but we need big-endian
-	word = ((word & 0x00FF) << 8) | ((word & 0xFF00) >> 8);
+void QSPI_WriteWord(uint32_t addr, uint16_t word)
+{
+	OCTOSPI_TypeDef *ospi = hospi1.Instance;
+
+	qspi_indirect();
+	while (ospi->SR & OCTOSPI_SR_BUSY) ;
+	MODIFY_REG(ospi->CR, OCTOSPI_CR_FMODE, 0);	// indirect write
+	ospi->DLR = 2 - 1;
+	ospi->CCR = QSPI_CCR_WORD;
+	ospi->TCR = mTcrWrite;
+	ospi->IR  = 0xF8;
+	ospi->AR  = addr;
+	*(__IO uint16_t *)&ospi->DR = qspi_swap16(word);	// starts the write
+
+	while (!(ospi->SR & (OCTOSPI_SR_TCF | OCTOSPI_SR_TEF))) ;
+	if (ospi->SR & OCTOSPI_SR_TEF) Error_Handler();
+	ospi->FCR = OCTOSPI_FCR_CTCF;
+}
+
+/**
+ * @brief Write one word through the HAL
+ *
+ * Kept for comparison with the register-level QSPI_WriteWord.
+ */
+void QSPI_WriteWordHal(uint32_t addr, uint16_t word)
+{
+	qspi_indirect();
+	word = qspi_swap16(word);
 	OSPI_RegularCmdTypeDef cmd = {
 		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
 		.FlashId               = HAL_OSPI_FLASH_ID_1,
@@ -198,6 +473,48 @@ void QSPI_WriteWord(uint32_t addr, uint16_t word) {
 	if (status != HAL_OK) Error_Handler();
 }
 
+/**
+ * @brief Time single-word reads and writes through the HAL and at register level
+ *
+ * Reads count words each way. The writes are count reset commands (0xF0 to
+ * address 0), so call with Vt mode exited.
+ *
+ * @param addr  First word read
+ * @param count Number of words, at most the size of hal and fast
+ * @param hal   Words read through the HAL
+ * @param fast  Words read at register level
+ * @param bench Cycle counts and words that differ between the two reads
+ */
+void QSPI_BenchWord(uint32_t addr, uint32_t count, uint16_t *hal, uint16_t *fast, DetOspiBench *bench)
+{
+	uint32_t start;
+
+	start = DWT->CYCCNT;
+	for (uint32_t i=0; i<count; i++)
+		hal[i] = QSPI_ReadWordHal(addr + i);
+	bench->ReadHal = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	for (uint32_t i=0; i<count; i++)
+		fast[i] = QSPI_ReadWord(addr + i);
+	bench->ReadFast = DWT->CYCCNT - start;
+
+	bench->Mismatches = 0;
+	for (uint32_t i=0; i<count; i++)
+		if (hal[i] != fast[i])
+			bench->Mismatches++;
+
+	start = DWT->CYCCNT;
+	for (uint32_t i=0; i<count; i++)
+		QSPI_WriteWordHal(0, 0xF0);
+	bench->WriteHal = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	for (uint32_t i=0; i<count; i++)
+		QSPI_WriteWord(0, 0xF0);
+	bench->WriteFast = DWT->CYCCNT - start;
+}
+
 void QSPI_WriteWords(uint32_t *addrs, uint16_t *words, uint32_t count)
 {
 	for (uint32_t i=0; i<count; i++) {
@@ -211,94 +528,192 @@ void QSPI_WriteBlock(uint32_t base, uint32_t count, uint16_t *block)
 		QSPI_WriteWord(base + i, block[i]);
 }
 
+// In an unlock bypass session program commands skip the two unlock cycles
+static uint32_t mUnlockBypass;
+
+/**
+ * @brief Enter unlock bypass mode, if the detector supports it
+ *
+ * Until QSPI_UnlockBypassExit, word and buffer programs are sent without
+ * the unlock cycles. Only programs (and reads) may be issued in between.
+ * Does nothing if CFI reports no unlock bypass, so callers need not check.
+ */
+void QSPI_UnlockBypassEnter(void)
+{
+	if (mUnlockBypass || !gDetInfo.CfiExtQuery.UnlockBypass)
+		return;
+	uint32_t addr[3] = { 0x555, 0x2AA, 0x555 };
+	uint16_t data[3] = { 0xAA,  0x55,  0x20 };
+	QSPI_WriteWords(addr, data, 3);
+	mUnlockBypass = 1;
+}
+
+/**
+ * @brief Leave unlock bypass mode, if in it
+ */
+void QSPI_UnlockBypassExit(void)
+{
+	if (!mUnlockBypass)
+		return;
+	QSPI_WriteWord(0, 0x90);
+	QSPI_WriteWord(0, 0x00);
+	mUnlockBypass = 0;
+}
+
 void QSPI_ProgramWord(uint32_t Address, uint16_t word)
 {
+	if (mUnlockBypass) {
+		QSPI_WriteWord(Address, 0xA0);
+		QSPI_WriteWord(Address, word);
+		return;
+	}
 	uint32_t addr[4] = { 0x555, 0x2AA, 0x555, Address };
 	uint16_t data[4] = { 0xAA,  0x55,  0xA0,  word };
 	QSPI_WriteWords(addr, data, 4);
 }
 
-void QSPI_ProgramBuffer(uint32_t Address, uint16_t *write_data, uint32_t count)
+// Used when the CFI buffer write time fields are zero
+#define QSPI_PROGRAM_TIMEOUT_US		4000
+
+#define QSPI_DQ7	0x0080
+#define QSPI_DQ5	0x0020
+#define QSPI_DQ3	0x0008
+
+static void qspi_reset(void)
 {
-	//for (uint32_t i=0; i<count; i++)
-	//	QSPI_ProgramWord(SectorAddress + i, data[i]);
+	uint32_t addr[3] = { 0x555, 0x2AA, 0x555 };
+	uint16_t data[3] = { 0xAA,  0x55,  0xF0 };
+	QSPI_WriteWords(addr, data, 3);
+	// leave the device in plain read mode: the session is over
+	QSPI_UnlockBypassExit();
+}
 
-	uint32_t SectorAddress = Address & 0xFFFF0000;
-	uint32_t EndAddress = Address + count;
+/**
+ * @brief Check once whether an embedded program or erase has finished
+ *
+ * While the operation runs DQ7 reads as the complement of bit 7 of the
+ * final data; it reads true once the operation is done (or an erase is
+ * suspended). DQ5 set means the device exceeded its internal time limit:
+ * DQ7 is read once more in case the operation finished at the same time,
+ * otherwise it failed and the device is reset to read mode.
+ *
+ * @param addr     Last address written (any address in the sector for erase)
+ * @param expected Last word written (0xFFFF for erase)
+ * @return DetError DET_OK, DET_BUSY or DET_ERR_FAILED
+ */
+DetError QSPI_CheckDQ7(uint32_t addr, uint16_t expected)
+{
+	uint16_t status = QSPI_ReadWord(addr);
+	if (!((status ^ expected) & QSPI_DQ7))
+		return DET_OK;
+	if (!(status & QSPI_DQ5))
+		return DET_BUSY;
+
+	status = QSPI_ReadWord(addr);
+	if (!((status ^ expected) & QSPI_DQ7))
+		return DET_OK;
+	qspi_reset();
+	return DET_ERR_FAILED;
+}
 
-	// prep page program entry sequence
-	// unlock 1, unlock 2, write buffer load, write word count minus 1, 1-32 addr/word pairs, write buffer program
-	uint32_t addr[37];
-	uint16_t data[37];
-	addr[0] = 0x555; data[0] = 0xAA;
-	addr[1] = 0x2AA; data[1] = 0x55;
-	addr[2] = SectorAddress; data[2] = 0x25;
-	addr[36] = SectorAddress; data[36] = 0x29;
-	// wc and data loaded below
-
-	// first page may not start on a page boundary
-	uint32_t remaining = 32 - (Address & 0x1F);
-	uint16_t wc = (count < remaining) ? count : remaining;
-	uint32_t data_index = 0;
-	while (Address < EndAddress) {
-		addr[3] = SectorAddress; data[3] = wc - 1;
-		for (uint32_t i=0; i<wc; i++) {
-			addr[4 + i] = Address + i;
-			data[4 + i] = write_data[data_index++];
+/**
+ * @brief Wait for an embedded program or erase to finish by data polling
+ *
+ * See QSPI_CheckDQ7. On timeout the device is reset to read mode; with a
+ * timeout of 0 this checks once and resets if not done.
+ *
+ * @param addr       Last address written (any address in the sector for erase)
+ * @param expected   Last word written (0xFFFF for erase)
+ * @param timeout_us Give up after this long
+ * @return DetError
+ */
+DetError QSPI_PollDQ7(uint32_t addr, uint16_t expected, uint32_t timeout_us)
+{
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	uint32_t last = DWT->CYCCNT;
+	uint32_t elapsed_us = 0;	// accumulated so CYCCNT may wrap during a long erase
+	DetError err;
+
+	while ((err = QSPI_CheckDQ7(addr, expected)) == DET_BUSY) {
+		uint32_t us = (DWT->CYCCNT - last) / cycles_per_us;
+		last += us * cycles_per_us;
+		elapsed_us += us;
+		if (elapsed_us >= timeout_us) {
+			qspi_reset();
+			return DET_ERR_TIMEOUT;
 		}
-		QSPI_WriteWords(addr, data, 5 + wc);
-		// wait for completion
-		// clock is 280MHz so 1us delay is 280 ticks and 500us is 140_000 ticks
-		qspi_delay(140000);
-		//HAL_Delay(1);
-		// prepare for next page
-		Address += wc;
-		count -= wc;
-		// last page may be partial
-		remaining = 32 - (Address & 0x1F);
-		wc = (count < remaining) ? count : remaining;
 	}
+
+	return err;
+}
+
+static uint32_t qspi_program_timeout(void)
+{
+	return DetCfiTimeout(gDetInfo.CfiInterface.TypTimeMaxMultiByteProgram,
+						 gDetInfo.CfiInterface.MaxTimeBufferWrite, QSPI_PROGRAM_TIMEOUT_US);
 }
 
-void QSPI_ProgramBuffer_single(uint32_t Address, uint16_t word, uint32_t count)
+// Write buffer program scratch: unlock 1, unlock 2, write buffer load,
+// word count minus 1, up to DET_WRITE_BUFFER_MAX_WORDS addr/word pairs, program confirm
+static uint32_t mProgAddr[DET_WRITE_BUFFER_MAX_WORDS + 5];
+static uint16_t mProgData[DET_WRITE_BUFFER_MAX_WORDS + 5];
+
+/**
+ * @brief Program count words with write-buffer programs of gDetWriteBufferWords
+ *
+ * @param Address    First word address
+ * @param write_data Words to program, or NULL to program word everywhere
+ * @param word       Word to program if write_data is NULL
+ * @param count      Number of words
+ * @return DetError
+ */
+static DetError qspi_program_pages(uint32_t Address, const uint16_t *write_data, uint16_t word, uint32_t count)
 {
-	uint32_t SectorAddress = Address & 0xFFFF0000;
 	uint32_t EndAddress = Address + count;
+	uint32_t timeout_us = qspi_program_timeout();
+	uint32_t page_words = gDetWriteBufferWords;		// power of 2, set in DetCtrlInit
+	uint32_t *addr = mProgAddr;
+	uint16_t *data = mProgData;
 
-	// prep page program entry sequence
-	// unlock 1, unlock 2, write buffer load, write word coun minus 1, 1-32 addr/word pairs, write buffer program
-	uint32_t addr[37];
-	uint16_t data[37];
 	addr[0] = 0x555; data[0] = 0xAA;
 	addr[1] = 0x2AA; data[1] = 0x55;
-	addr[2] = SectorAddress; data[2] = 0x25;
-	addr[36] = SectorAddress; data[36] = 0x29;
-	// wc and data loaded below
+	uint32_t first = mUnlockBypass ? 2 : 0;
 
-	// first page may not start on a page boundary
-	uint32_t remaining = 32 - (Address & 0x1F);
-	uint16_t wc = (count < remaining) ? count : remaining;
 	while (Address < EndAddress) {
+		// pages are aligned, so the first and last may be partial
+		uint32_t SectorAddress = Address & 0xFFFF0000;
+		uint32_t remaining = page_words - (Address & (page_words - 1));
+		uint32_t wc = (count < remaining) ? count : remaining;
+
+		addr[2] = SectorAddress; data[2] = 0x25;
 		addr[3] = SectorAddress; data[3] = wc - 1;
 		for (uint32_t i=0; i<wc; i++) {
 			addr[4 + i] = Address + i;
-			data[4 + i] = word;
+			data[4 + i] = write_data ? *write_data++ : word;
 		}
-		QSPI_WriteWords(addr, data, 5 + wc);
+		addr[4 + wc] = SectorAddress; data[4 + wc] = 0x29;
+		QSPI_WriteWords(addr + first, data + first, 5 + wc - first);
+
 		// wait for completion
-		// clock is 280MHz so 1us delay is 280 ticks and 500us is 140_000 ticks
-		qspi_delay(140000);
-		//HAL_Delay(1);
-		// prepare for next page
+		DetError err = QSPI_PollDQ7(addr[3 + wc], data[3 + wc], timeout_us);
+		if (err != DET_OK)
+			return err;
+
 		Address += wc;
 		count -= wc;
-		// last page may be partial
-		remaining = 32 - (Address & 0x1F);
-		wc = (count < remaining) ? count : remaining;
 	}
 
-	//for (uint32_t i=0; i<count; i++)
-	//	QSPI_ProgramWord(SectorAddress + i, word);
+	return DET_OK;
+}
+
+DetError QSPI_ProgramBuffer(uint32_t Address, uint16_t *write_data, uint32_t count)
+{
+	return qspi_program_pages(Address, write_data, 0, count);
+}
+
+DetError QSPI_ProgramBuffer_single(uint32_t Address, uint16_t word, uint32_t count)
+{
+	return qspi_program_pages(Address, NULL, word, count);
 }
 
 void QSPI_EraseSector(uint32_t SectorAddress)
@@ -308,6 +723,41 @@ void QSPI_EraseSector(uint32_t SectorAddress)
 	QSPI_WriteWords(addr, data, 6);
 }
 
+/**
+ * @brief Start one erase of several sectors
+ *
+ * After the first sector erase command the device accepts further sector
+ * addresses, each with 0x30, until its erase timeout window (about 50 us)
+ * closes; all accepted sectors are then erased in one operation. DQ3 reads
+ * 1 once the window has closed. It is checked before each further sector,
+ * and after the last, so a sector whose command may have been ignored is
+ * not counted.
+ *
+ * @param addrs Any address in each sector
+ * @param count Number of sectors
+ * @return uint32_t Number of sectors accepted (at least 1 if count > 0);
+ *         wait for completion with QSPI_PollDQ7, then erase the rest
+ */
+uint32_t QSPI_EraseSectors(uint32_t *addrs, uint32_t count)
+{
+	if (count == 0)
+		return 0;
+
+	QSPI_EraseSector(addrs[0]);
+
+	uint32_t accepted = 1;
+	while (accepted < count) {
+		if (QSPI_ReadWord(addrs[0]) & QSPI_DQ3)
+			break;
+		QSPI_WriteWord(addrs[accepted], 0x30);
+		if (QSPI_ReadWord(addrs[0]) & QSPI_DQ3)
+			break;		// may have been too late
+		accepted++;
+	}
+
+	return accepted;
+}
+
 void QSPI_EraseChip(void)
 {
 	uint32_t addr[6] = { 0x555, 0x2AA, 0x555, 0x555, 0x2AA, 0x555 };
@@ -317,6 +767,7 @@ void QSPI_EraseChip(void)
 
 void QSPI_EnterVt(void)
 {
+	qspi_indirect();
 	OSPI_RegularCmdTypeDef cmd = {
 		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
 		.FlashId               = HAL_OSPI_FLASH_ID_1,
@@ -381,6 +832,7 @@ void QSPI_ExitVt(void)
 
 void QSPI_EnterCfgFlash(void)
 {
+	qspi_indirect();
 	OSPI_RegularCmdTypeDef cmd = {
 		.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG,
 		.FlashId               = HAL_OSPI_FLASH_ID_1,
@@ -8,21 +8,41 @@
 
 #include "det_ctrl.h"
 
+typedef enum {
+	DET_SWAP_MDMA,		// MDMA byte exchange during the transfer
+	DET_SWAP_REV16,		// CPU, two half-words per REV16
+	DET_SWAP_SCALAR		// CPU, one half-word at a time
+} det_swap;
+
 extern void	    QSPI_Open(void);
 extern void	    QSPI_Close(void);
 
 extern uint16_t	QSPI_ReadWord(uint32_t addr);
+extern uint16_t	QSPI_ReadWordHal(uint32_t addr);
 extern void	    QSPI_ReadWords(uint32_t *addrs, uint16_t *dest, uint32_t count);
 extern void	    QSPI_ReadBlock(uint32_t base, uint32_t count, uint16_t *dest);
+extern void	    QSPI_ReadBlockStart(uint32_t base, uint32_t count, uint16_t *dest);
+extern void	    QSPI_ReadBlockWait(void);
+extern void	    QSPI_SetSwapMode(det_swap mode);
+extern void	    QSPI_Swap16Scalar(uint16_t *data, uint32_t count);
+extern void	    QSPI_Swap16Rev16(uint16_t *data, uint32_t count);
+extern void	    QSPI_BenchSwap(uint32_t base, uint32_t count, uint16_t *dest, DetSwapBench *bench);
 extern void	    QSPI_ReadPage(uint32_t PageAddress, uint16_t *dest);
 extern void	    QSPI_WriteWord(uint32_t addr, uint16_t word);
+extern void	    QSPI_WriteWordHal(uint32_t addr, uint16_t word);
+extern void	    QSPI_BenchWord(uint32_t addr, uint32_t count, uint16_t *hal, uint16_t *fast, DetOspiBench *bench);
 extern void     QSPI_WriteWords(uint32_t *addrs, uint16_t *words, uint32_t count);
 extern void	    QSPI_WriteBlock(uint32_t base, uint32_t count, uint16_t *block);
+extern void     QSPI_UnlockBypassEnter(void);
+extern void     QSPI_UnlockBypassExit(void);
 extern void     QSPI_ProgramWord(uint32_t Address, uint16_t word);
-extern void	    QSPI_ProgramBuffer(uint32_t SectorAddress, uint16_t *data, uint32_t count);
-extern void	    QSPI_ProgramBuffer_single(uint32_t SectorAddress, uint16_t word, uint32_t count);
+extern DetError QSPI_ProgramBuffer(uint32_t SectorAddress, uint16_t *data, uint32_t count);
+extern DetError QSPI_ProgramBuffer_single(uint32_t SectorAddress, uint16_t word, uint32_t count);
+extern DetError QSPI_CheckDQ7(uint32_t addr, uint16_t expected);
+extern DetError QSPI_PollDQ7(uint32_t addr, uint16_t expected, uint32_t timeout_us);
 extern void	    QSPI_EraseSector(uint32_t SectorAddress);
 extern void	    QSPI_EraseChip(void);
+extern uint32_t QSPI_EraseSectors(uint32_t *addrs, uint32_t count);
 extern void     QSPI_EnterVt(void);
 extern void     QSPI_ExitVt(void);
 extern void     QSPI_EnterCfgFlash(void);
@@ -0,0 +1,141 @@
+/**
+ * @file log.c
+ * @brief Deferred logging
+ */
+
+#include "log.h"
+#include "main.h"
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_RECORDS		256		// power of 2
+#define LOG_LINE_MAX	128		// longest formatted record, longer lines are truncated
+#define LOG_UART_BUF	1024
+
+typedef struct {
+	volatile uint32_t	Seq;	// index + 1 once written, 0 while being written
+	uint32_t			Tick;
+	const char			*Fmt;
+	uint32_t			Level;
+	uint32_t			Args[3];
+} LogRecord;
+
+static LogRecord mLog[LOG_RECORDS];
+static volatile uint32_t mLogHead;	// index of next record to write
+
+// UART drain
+extern UART_HandleTypeDef huart3;
+static LogCursor mLogUart;
+static char mLogUartBuf[LOG_UART_BUF] AXI_BSS;	// DMA source: not in DTCM
+
+/**
+ * @brief Store a log record
+ *
+ * Lock-free: a slot is claimed with an exclusive increment of the head, so
+ * this may interrupt, or be interrupted by, another LogWrite. When the ring
+ * is full the oldest record is overwritten.
+ *
+ * @note Use the LOG_* macros rather than calling this directly
+ */
+void LogWrite(uint32_t level, const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+	uint32_t index;
+	do {
+		index = __LDREXW(&mLogHead);
+	} while (__STREXW(index + 1, &mLogHead));
+
+	LogRecord *rec = &mLog[index % LOG_RECORDS];
+	rec->Seq = 0;
+	__DMB();
+	rec->Tick    = HAL_GetTick();
+	rec->Fmt     = fmt;
+	rec->Level   = level;
+	rec->Args[0] = a0;
+	rec->Args[1] = a1;
+	rec->Args[2] = a2;
+	__DMB();
+	rec->Seq = index + 1;
+}
+
+/**
+ * @brief Format the next record for a reader
+ *
+ * @note Runs in main loop. Readers do not consume records for each other:
+ * each has its own cursor.
+ *
+ * @param cursor Reader position
+ * @param buf    Output, not NUL-terminated
+ * @param size   Space in buf
+ * @return uint32_t Bytes written, 0 if there is no record or it does not fit in size
+ */
+uint32_t LogFormatNext(LogCursor *cursor, char *buf, uint32_t size)
+{
+	for (;;) {
+		uint32_t head = mLogHead;
+
+		// skip records already overwritten
+		if (head - cursor->Next > LOG_RECORDS) {
+			cursor->Lost += head - cursor->Next - LOG_RECORDS;
+			cursor->Next  = head - LOG_RECORDS;
+		}
+		if (cursor->Next == head)
+			return 0;
+
+		LogRecord *rec = &mLog[cursor->Next % LOG_RECORDS];
+		uint32_t seq = rec->Seq;
+		if ((int32_t)(seq - (cursor->Next + 1)) < 0 || seq == 0)
+			return 0;	// claimed but not yet written
+
+		LogRecord copy = *rec;
+		__DMB();
+		if (seq != cursor->Next + 1 || rec->Seq != seq) {
+			// overwritten before or while copying
+			cursor->Lost++;
+			cursor->Next++;
+			continue;
+		}
+
+		char line[LOG_LINE_MAX];
+		static const char levels[] = "EWID";
+		int n = snprintf(line, sizeof(line), "[%8lu] %c ", (unsigned long)copy.Tick, levels[copy.Level & 3]);
+		n += snprintf(line + n, sizeof(line) - n, copy.Fmt, copy.Args[0], copy.Args[1], copy.Args[2]);
+		if (n > (int)sizeof(line) - 1)
+			n = sizeof(line) - 1;
+		line[n++] = '\n';
+
+		if ((uint32_t)n > size)
+			return 0;
+
+		memcpy(buf, line, n);
+		cursor->Next++;
+		return n;
+	}
+}
+
+/**
+ * @brief Send pending log records to the UART
+ *
+ * Starts a DMA transfer of as many formatted records as fit, if the UART is idle.
+ *
+ * @note Runs in main loop
+ */
+void LogDrainUart(void)
+{
+	if (huart3.gState != HAL_UART_STATE_READY)
+		return;
+
+	uint32_t len = 0;
+	uint32_t lost = mLogUart.Lost;
+	for (;;) {
+		uint32_t n = LogFormatNext(&mLogUart, mLogUartBuf + len, sizeof(mLogUartBuf) - len);
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	if (mLogUart.Lost != lost && sizeof(mLogUartBuf) - len >= 32)
+		len += snprintf(mLogUartBuf + len, sizeof(mLogUartBuf) - len, "[log] %lu lost\n", (unsigned long)(mLogUart.Lost - lost));
+
+	if (len > 0)
+		HAL_UART_Transmit_DMA(&huart3, (uint8_t *)mLogUartBuf, len);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file log.h
+ * @brief Deferred logging
+ *
+ * Log calls store a binary record (tick, level, format string, up to three
+ * arguments) in a ring and return. Records are formatted later, from the
+ * main loop, when they are drained to the UART or read over USB. Logging
+ * never blocks, so it is safe in interrupts.
+ *
+ * The format string must be a literal. Arguments are stored as uint32_t, so
+ * they must be integers (use %lu, %ld or %lx), not strings or floats.
+ *
+ * Levels above LOG_LEVEL are compiled out.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#define LOG_LEVEL_ERROR		0
+#define LOG_LEVEL_WARN		1
+#define LOG_LEVEL_INFO		2
+#define LOG_LEVEL_DEBUG		3
+
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+// Pad the arguments with zeros so every call passes three
+#define LOG_AT(lvl, fmt, a0, a1, a2, ...) do { \
+	if ((lvl) <= LOG_LEVEL) LogWrite((lvl), (fmt), (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2)); \
+} while (0)
+
+#define LOG_ERROR(...)	LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__, 0, 0, 0)
+#define LOG_WARN(...)	LOG_AT(LOG_LEVEL_WARN,  __VA_ARGS__, 0, 0, 0)
+#define LOG_INFO(...)	LOG_AT(LOG_LEVEL_INFO,  __VA_ARGS__, 0, 0, 0)
+#define LOG_DEBUG(...)	LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__, 0, 0, 0)
+
+/**
+ * @brief Read position of one log reader
+ */
+typedef struct {
+	uint32_t	Next;		// index of next record to read
+	uint32_t	Lost;		// records overwritten before they were read
+} LogCursor;
+
+extern void LogWrite(uint32_t level, const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2);
+extern uint32_t LogFormatNext(LogCursor *cursor, char *buf, uint32_t size);
+extern void LogDrainUart(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // !LOG_H
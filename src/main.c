@@ -11,24 +11,34 @@
 #include "comms_hpt_msgs.h"
 #include "det_ctrl.h"
 #include "analog.h"
+#include "log.h"
 
 /* Private variables ---------------------------------------------------------*/
 
 CRC_HandleTypeDef  hcrc;
 OSPI_HandleTypeDef hospi1;
+MDMA_HandleTypeDef hmdma_octospi1_fifo_th;
 SPI_HandleTypeDef  hspi1;
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef  hdma_usart3_tx;
 TIM_HandleTypeDef  htim12;
 TIM_HandleTypeDef  htim13;
 
 volatile int gMainLoopSemaphore;
+volatile int gHousekeepingTick;
 volatile uint32_t gResetFlags;
 volatile uint32_t gSysReqReset;
+volatile uint32_t gIsrUsbCalls;
+volatile uint32_t gIsrUsbMaxCycles;
+volatile uint64_t gIsrUsbTotalCycles;
 // TODO: Move this to a header?
 uint32_t g_config_save_requested;
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
+#ifdef DET_QSPI_MEMORY_MAPPED
+static void MPU_Config(void);
+#endif
 static void MX_GPIO_Init(void);
 static void MX_CRC_Init(void);
 static void MX_OCTOSPI1_Init(void);
@@ -58,6 +68,11 @@ typedef union __packed __aligned(4) {
 		float DAC2_CalC0;
 		float DAC2_CalC1;
 		uint32_t nwrites;
+		// settling time models; 0 in configs saved before they were added
+		float DAC1_SettleC0;
+		float DAC1_SettleC1;
+		float DAC2_SettleC0;
+		float DAC2_SettleC1;
 	};
 	struct {
 		uint8_t raw_payload[8192-4];
@@ -80,6 +95,10 @@ void FlashConfigSave(void)
 	gAppRamConfig.DAC1_CalC1 = gDac1.CalC1;
 	gAppRamConfig.DAC2_CalC0 = gDac2.CalC0;
 	gAppRamConfig.DAC2_CalC1 = gDac2.CalC1;
+	gAppRamConfig.DAC1_SettleC0 = gDac1.SettleC0;
+	gAppRamConfig.DAC1_SettleC1 = gDac1.SettleC1;
+	gAppRamConfig.DAC2_SettleC0 = gDac2.SettleC0;
+	gAppRamConfig.DAC2_SettleC1 = gDac2.SettleC1;
 	gAppRamConfig.nwrites++;
 	// calculate CRC in ram
 	gAppRamConfig.crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)gAppRamConfig.raw_payload, sizeof(gAppRamConfig) / 4 - 1);
@@ -132,6 +151,10 @@ void FlashConfigReset(void) {
 	gAppRamConfig.DAC1_CalC1 = 1.0f;
 	gAppRamConfig.DAC2_CalC0 = 0.0f;
 	gAppRamConfig.DAC2_CalC1 = 1.0f;
+	gAppRamConfig.DAC1_SettleC0 = 0.0f;
+	gAppRamConfig.DAC1_SettleC1 = 0.0f;
+	gAppRamConfig.DAC2_SettleC0 = 0.0f;
+	gAppRamConfig.DAC2_SettleC1 = 0.0f;
 	gAppRamConfig.nwrites = 0;
 	FlashConfigSave();
 }
@@ -168,6 +191,11 @@ int main(void)
 	/* Save reset reason -------------------------------------------------------*/
 	SaveResets();
 
+#ifdef DET_QSPI_MEMORY_MAPPED
+	/* MPU Configuration--------------------------------------------------------*/
+	MPU_Config();
+#endif
+
 	/* Enable I-Cache---------------------------------------------------------*/
 	SCB_EnableICache();
 
@@ -179,6 +207,12 @@ int main(void)
 	/* Configure the system clock */
 	SystemClock_Config();
 
+	// Start the DWT cycle counter, used to measure interrupt residency
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 	/* Initialize all configured peripherals */
 	MX_GPIO_Init();
 	MX_CRC_Init();
@@ -187,12 +221,15 @@ int main(void)
 	MX_USART3_UART_Init();
 	MX_TIM12_Init();
 	MX_TIM13_Init();
+	comms_usb_hpt_reset();
 	MX_USB_DEVICE_Init();
 
 	// Load config from flash
 	FlashConfigInit();
 
 	DacInit(gAppRamConfig.DAC1_CalC0, gAppRamConfig.DAC1_CalC1, gAppRamConfig.DAC2_CalC0, gAppRamConfig.DAC2_CalC1);
+	DacSetSettle(1, gAppRamConfig.DAC1_SettleC0, gAppRamConfig.DAC1_SettleC1);
+	DacSetSettle(2, gAppRamConfig.DAC2_SettleC0, gAppRamConfig.DAC2_SettleC1);
 	// The detector driver may take a while to reset
 	HAL_Delay(200);
 	DetCtrlInit();
@@ -222,23 +259,63 @@ int main(void)
 			HAL_GPIO_WritePin(LD1_GPIO_Port, LD1_Pin, GPIO_PIN_RESET);
 		}
 
-		det_reset_count++;
-		if (det_reset_count >= DET_RESET_PERIOD) {
-			det_reset_count = 0;
-			// disable comms interrupt
-			NVIC_DisableIRQ(OTG_HS_IRQn);
-			if (!gDetVtRequested) {
-				DetExitVtMode();
+		if (gHousekeepingTick) {
+			gHousekeepingTick = 0;
+			det_reset_count++;
+			if (det_reset_count >= DET_RESET_PERIOD) {
+				det_reset_count = 0;
+				// disable comms interrupt
+				NVIC_DisableIRQ(OTG_HS_IRQn);
+				if (!gDetVtRequested) {
+					DetExitVtMode();
+				}
+				gDetVtRequested = 0;
+				// enable comms interrupt
+				NVIC_EnableIRQ(OTG_HS_IRQn);
 			}
-			gDetVtRequested = 0;
-			// enable comms interrupt
-			NVIC_EnableIRQ(OTG_HS_IRQn);
 		}
 
-		HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+		LogDrainUart();
+
+		// Sleep until an interrupt or a queued command (SEV). WFE returns at once if
+		// a command was queued since the check, so no wakeup is lost. Not
+		// HAL_PWR_EnterSLEEPMode: its WFE entry clears the event first.
+		if (!gMainLoopSemaphore && !gHousekeepingTick)
+			__WFE();
 	}
 }
 
+#ifdef DET_QSPI_MEMORY_MAPPED
+/**
+ * @brief Make the OSPI memory-mapped window Device memory
+ *
+ * The default map makes it Normal memory, which the core may read
+ * speculatively. A speculative read would start a detector read and
+ * disturb the stream the driver is reading.
+ */
+static void MPU_Config(void)
+{
+	MPU_Region_InitTypeDef MPU_InitStruct = {0};
+
+	HAL_MPU_Disable();
+
+	MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+	MPU_InitStruct.Number = MPU_REGION_NUMBER0;
+	MPU_InitStruct.BaseAddress = OCTOSPI1_BASE;
+	MPU_InitStruct.Size = MPU_REGION_SIZE_256MB;
+	MPU_InitStruct.SubRegionDisable = 0x0;
+	MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL0;
+	MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+	MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	MPU_InitStruct.IsShareable = MPU_ACCESS_SHAREABLE;
+	MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+	MPU_InitStruct.IsBufferable = MPU_ACCESS_BUFFERABLE;
+	HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+	HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+#endif
+
 /**
  * @brief System Clock Configuration
  * @retval None
@@ -334,7 +411,7 @@ static void MX_OCTOSPI1_Init(void)
 
 	/* OCTOSPI1 parameter configuration*/
 	hospi1.Instance = OCTOSPI1;
-	hospi1.Init.FifoThreshold = 1;
+	hospi1.Init.FifoThreshold = 2; // one MDMA half-word per request
 	hospi1.Init.DualQuad = HAL_OSPI_DUALQUAD_DISABLE;
 	hospi1.Init.MemoryType = HAL_OSPI_MEMTYPE_MICRON;
 	hospi1.Init.DeviceSize = 32;
@@ -13,13 +13,20 @@ extern "C" {
 /* Includes ------------------------------------------------------------------*/
 #include "stm32h7xx_hal.h"
 
+/* Exported macros -----------------------------------------------------------*/
+#define AXI_BSS __attribute__((section(".axi_bss"))) // place uninitialized buffer in AXI SRAM
+
 /* Exported functions prototypes ---------------------------------------------*/
 void Error_Handler(void);
 
 /* Exported variables --------------------------------------------------------*/
-extern volatile int gMainLoopSemaphore; // Set by tim13 isr, reset in main loop
+extern volatile int gMainLoopSemaphore; // Set when a command is queued, reset in main loop
+extern volatile int gHousekeepingTick; // Set by tim13 isr, reset in main loop
 extern volatile uint32_t gResetFlags; // capture reset flags
 extern volatile uint32_t gSysReqReset; // set to request a software reset
+extern volatile uint32_t gIsrUsbCalls; // number of USB interrupts
+extern volatile uint32_t gIsrUsbMaxCycles; // longest USB interrupt in CPU cycles
+extern volatile uint64_t gIsrUsbTotalCycles; // total time in USB interrupt in CPU cycles
 
 /* Private defines -----------------------------------------------------------*/
 #define B1_Pin GPIO_PIN_13
@@ -0,0 +1,123 @@
+/**
+ * @file rle.c
+ * @brief Run-length encoding of detector words
+ */
+
+#include "rle.h"
+
+static inline uint16_t rleWordType(uint16_t w)
+{
+	if (w == 0x0000) return RLE_TYPE_ZEROS;
+	if (w == 0xFFFF) return RLE_TYPE_ONES;
+	return RLE_TYPE_LITERAL;
+}
+
+/**
+ * @brief Start encoding into out
+ *
+ * @param enc Encoder state
+ * @param out Output buffer
+ * @param cap Output buffer size in words
+ */
+void RleEncoderInit(RleEncoder *enc, uint16_t *out, uint32_t cap)
+{
+	enc->Out   = out;
+	enc->Cap   = cap;
+	enc->Len   = 0;
+	enc->Token = cap;
+}
+
+/**
+ * @brief Encode words, continuing the stream from any previous call
+ *
+ * The output is a complete stream after every call; a run that continues
+ * into the next call extends the last token.
+ *
+ * @param enc   Encoder state
+ * @param in    Input words
+ * @param count Number of input words
+ * @return Number of input words consumed, less than count once the output is full
+ */
+uint32_t RleEncode(RleEncoder *enc, const uint16_t *in, uint32_t count)
+{
+	uint16_t *out = enc->Out;
+	uint32_t cap  = enc->Cap;
+	uint32_t len  = enc->Len;
+	uint32_t tok  = enc->Token;
+	uint32_t i    = 0;
+
+	while (i < count) {
+		uint16_t w    = in[i];
+		uint16_t type = rleWordType(w);
+		uint16_t open = tok < cap ? (out[tok] & RLE_TYPE_MASK) : RLE_TYPE_LITERAL;
+
+		// A lone 0x0000/0xFFFF inside literals is cheaper kept as a literal
+		if (type != RLE_TYPE_LITERAL && tok < cap && open == RLE_TYPE_LITERAL && (i + 1 >= count || in[i+1] != w))
+			type = RLE_TYPE_LITERAL;
+
+		if (tok >= cap || open != type || (out[tok] & RLE_COUNT_MASK) == RLE_COUNT_MASK) {
+			// open a new token
+			if (len + (type == RLE_TYPE_LITERAL ? 2 : 1) > cap)
+				break;
+			tok = len;
+			out[len++] = type;
+		}
+
+		uint32_t n = out[tok] & RLE_COUNT_MASK;
+		if (type == RLE_TYPE_LITERAL) {
+			if (len >= cap)
+				break;
+			out[len++] = w;
+			n++;
+			i++;
+		} else {
+			// runs are the common case: scan without touching the output
+			while (i < count && in[i] == w && n < RLE_COUNT_MASK) {
+				n++;
+				i++;
+			}
+		}
+		out[tok] = type | n;
+	}
+
+	enc->Len   = len;
+	enc->Token = tok;
+	return i;
+}
+
+/**
+ * @brief Decode a stream
+ *
+ * @param in  Encoded words
+ * @param len Number of encoded words
+ * @param out Output buffer
+ * @param cap Output buffer size in words
+ * @return Number of words decoded, or 0xFFFFFFFF if the stream is malformed or does not fit
+ */
+uint32_t RleDecode(const uint16_t *in, uint32_t len, uint16_t *out, uint32_t cap)
+{
+	uint32_t n = 0;
+	uint32_t i = 0;
+
+	while (i < len) {
+		uint16_t type  = in[i] & RLE_TYPE_MASK;
+		uint32_t count = in[i] & RLE_COUNT_MASK;
+		i++;
+
+		if (type == (RLE_TYPE_ZEROS | RLE_TYPE_ONES) || count > cap - n)
+			return 0xFFFFFFFF;
+
+		if (type == RLE_TYPE_LITERAL) {
+			if (count > len - i)
+				return 0xFFFFFFFF;
+			for (uint32_t j=0; j<count; j++)
+				out[n++] = in[i++];
+		} else {
+			uint16_t w = type == RLE_TYPE_ONES ? 0xFFFF : 0x0000;
+			for (uint32_t j=0; j<count; j++)
+				out[n++] = w;
+		}
+	}
+
+	return n;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file rle.h
+ * @brief Run-length encoding of detector words
+ *
+ * The stream is a sequence of tokens. Each token starts with a 16-bit header:
+ * the top 2 bits give the token type and the low 14 bits the word count (1..16383).
+ *   RLE_TYPE_LITERAL: count literal words follow the header
+ *   RLE_TYPE_ZEROS:   count words of 0x0000 (programmed)
+ *   RLE_TYPE_ONES:    count words of 0xFFFF (erased)
+ *
+ * This module has no hardware dependencies and builds on the host.
+ */
+
+#ifndef RLE_H
+#define RLE_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#define RLE_TYPE_LITERAL	0x0000
+#define RLE_TYPE_ZEROS		0x4000
+#define RLE_TYPE_ONES		0x8000
+#define RLE_TYPE_MASK		0xC000
+#define RLE_COUNT_MASK		0x3FFF
+
+typedef struct {
+	uint16_t	*Out;		// output buffer
+	uint32_t	Cap;		// output buffer size in words
+	uint32_t	Len;		// output words used
+	uint32_t	Token;		// index of the open token header in Out, or Cap if none
+} RleEncoder;
+
+extern void RleEncoderInit(RleEncoder *enc, uint16_t *out, uint32_t cap);
+extern uint32_t RleEncode(RleEncoder *enc, const uint16_t *in, uint32_t count);
+extern uint32_t RleDecode(const uint16_t *in, uint32_t len, uint16_t *out, uint32_t cap);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // !RLE_H
@@ -41,7 +41,8 @@
 
 /* Private variables ---------------------------------------------------------*/
 /* USER CODE BEGIN PV */
-
+extern DMA_HandleTypeDef hdma_usart3_tx;
+extern MDMA_HandleTypeDef hmdma_octospi1_fifo_th;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -181,7 +182,34 @@ void HAL_OSPI_MspInit(OSPI_HandleTypeDef* hospi)
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
   /* USER CODE BEGIN OCTOSPI1_MspInit 1 */
+    /* OCTOSPI1 MDMA Init: FIFO threshold request, one half-word per request (FifoThreshold = 2).
+       Bytes are exchanged within each half-word so reads arrive big-endian; see QSPI_SetSwapMode */
+    __HAL_RCC_MDMA_CLK_ENABLE();
+    hmdma_octospi1_fifo_th.Instance = MDMA_Channel0;
+    hmdma_octospi1_fifo_th.Init.Request = MDMA_REQUEST_OCTOSPI1_FIFO_TH;
+    hmdma_octospi1_fifo_th.Init.TransferTriggerMode = MDMA_BUFFER_TRANSFER;
+    hmdma_octospi1_fifo_th.Init.Priority = MDMA_PRIORITY_HIGH;
+    hmdma_octospi1_fifo_th.Init.Endianness = MDMA_LITTLE_BYTE_ENDIANNESS_EXCHANGE;
+    hmdma_octospi1_fifo_th.Init.SourceInc = MDMA_SRC_INC_HALFWORD;
+    hmdma_octospi1_fifo_th.Init.DestinationInc = MDMA_DEST_INC_HALFWORD;
+    hmdma_octospi1_fifo_th.Init.SourceDataSize = MDMA_SRC_DATASIZE_HALFWORD;
+    hmdma_octospi1_fifo_th.Init.DestDataSize = MDMA_DEST_DATASIZE_HALFWORD;
+    hmdma_octospi1_fifo_th.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+    hmdma_octospi1_fifo_th.Init.BufferTransferLength = 2;
+    hmdma_octospi1_fifo_th.Init.SourceBurst = MDMA_SOURCE_BURST_SINGLE;
+    hmdma_octospi1_fifo_th.Init.DestBurst = MDMA_DEST_BURST_SINGLE;
+    hmdma_octospi1_fifo_th.Init.SourceBlockAddressOffset = 0;
+    hmdma_octospi1_fifo_th.Init.DestBlockAddressOffset = 0;
+    if (HAL_MDMA_Init(&hmdma_octospi1_fifo_th) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(hospi, hmdma, hmdma_octospi1_fifo_th);
 
+    HAL_NVIC_SetPriority(MDMA_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(MDMA_IRQn);
+    HAL_NVIC_SetPriority(OCTOSPI1_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(OCTOSPI1_IRQn);
   /* USER CODE END OCTOSPI1_MspInit 1 */
   }
 
@@ -218,7 +246,8 @@ void HAL_OSPI_MspDeInit(OSPI_HandleTypeDef* hospi)
     HAL_GPIO_DeInit(GPIOB, GPIO_PIN_10);
 
   /* USER CODE BEGIN OCTOSPI1_MspDeInit 1 */
-
+    HAL_MDMA_DeInit(hospi->hmdma);
+    HAL_NVIC_DisableIRQ(OCTOSPI1_IRQn);
   /* USER CODE END OCTOSPI1_MspDeInit 1 */
   }
 
@@ -367,7 +396,28 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
 
   /* USER CODE BEGIN USART3_MspInit 1 */
+    /* USART3 DMA Init: TX only, used to drain the log */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    hdma_usart3_tx.Instance = DMA1_Stream0;
+    hdma_usart3_tx.Init.Request = DMA_REQUEST_USART3_TX;
+    hdma_usart3_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_usart3_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart3_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart3_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart3_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart3_tx.Init.Mode = DMA_NORMAL;
+    hdma_usart3_tx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_usart3_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart3_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(huart, hdmatx, hdma_usart3_tx);
 
+    HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
+    HAL_NVIC_SetPriority(USART3_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(USART3_IRQn);
   /* USER CODE END USART3_MspInit 1 */
   }
 
@@ -396,7 +446,9 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     HAL_GPIO_DeInit(GPIOD, STLINK_RX_Pin|STLINK_TX_Pin);
 
   /* USER CODE BEGIN USART3_MspDeInit 1 */
-
+    HAL_DMA_DeInit(huart->hdmatx);
+    HAL_NVIC_DisableIRQ(DMA1_Stream0_IRQn);
+    HAL_NVIC_DisableIRQ(USART3_IRQn);
   /* USER CODE END USART3_MspDeInit 1 */
   }
 
@@ -56,7 +56,11 @@
 
 /* External variables --------------------------------------------------------*/
 extern PCD_HandleTypeDef hpcd_USB_OTG_HS;
+extern OSPI_HandleTypeDef hospi1;
+extern MDMA_HandleTypeDef hmdma_octospi1_fifo_th;
 extern TIM_HandleTypeDef htim13;
+extern UART_HandleTypeDef huart3;
+extern DMA_HandleTypeDef hdma_usart3_tx;
 /* USER CODE BEGIN EV */
 
 /* USER CODE END EV */
@@ -151,7 +155,7 @@ void SysTick_Handler(void)
 void TIM8_UP_TIM13_IRQHandler(void)
 {
 	HAL_TIM_IRQHandler(&htim13);
-	gMainLoopSemaphore = 1;
+	gHousekeepingTick = 1;
 }
 
 /**
@@ -159,5 +163,45 @@ void TIM8_UP_TIM13_IRQHandler(void)
   */
 void OTG_HS_IRQHandler(void)
 {
+	uint32_t start = DWT->CYCCNT;
+
 	HAL_PCD_IRQHandler(&hpcd_USB_OTG_HS);
+
+	uint32_t cycles = DWT->CYCCNT - start;
+	gIsrUsbCalls++;
+	gIsrUsbTotalCycles += cycles;
+	if (cycles > gIsrUsbMaxCycles)
+		gIsrUsbMaxCycles = cycles;
+}
+
+/**
+  * @brief This function handles OCTOSPI1 global interrupt (detector DMA read complete).
+  */
+void OCTOSPI1_IRQHandler(void)
+{
+	HAL_OSPI_IRQHandler(&hospi1);
+}
+
+/**
+  * @brief This function handles MDMA global interrupt.
+  */
+void MDMA_IRQHandler(void)
+{
+	HAL_MDMA_IRQHandler(&hmdma_octospi1_fifo_th);
+}
+
+/**
+  * @brief This function handles DMA1 stream0 global interrupt (USART3 TX, log drain).
+  */
+void DMA1_Stream0_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_usart3_tx);
+}
+
+/**
+  * @brief This function handles USART3 global interrupt.
+  */
+void USART3_IRQHandler(void)
+{
+	HAL_UART_IRQHandler(&huart3);
 }
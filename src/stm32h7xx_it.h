@@ -57,6 +57,10 @@ void PendSV_Handler(void);
 void SysTick_Handler(void);
 void TIM8_UP_TIM13_IRQHandler(void);
 void OTG_HS_IRQHandler(void);
+void OCTOSPI1_IRQHandler(void);
+void MDMA_IRQHandler(void);
+void DMA1_Stream0_IRQHandler(void);
+void USART3_IRQHandler(void);
 /* USER CODE BEGIN EFP */
 
 /* USER CODE END EFP */
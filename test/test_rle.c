@@ -0,0 +1,209 @@
+/**
+ * @file test_rle.c
+ * @brief Host round-trip test of the RLE encoder and decoder
+ *
+ * Build and run with `make test-rle`. Exits non-zero on the first failure.
+ */
+
+#include "rle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_MAX_WORDS	(4 * RLE_COUNT_MASK + 1000)
+
+static uint16_t mIn[TEST_MAX_WORDS];
+static uint16_t mEnc[2 * TEST_MAX_WORDS];
+static uint16_t mDec[TEST_MAX_WORDS];
+
+static int mFailures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		mFailures++; \
+		return; \
+	} \
+} while (0)
+
+// Encode count words in calls of at most chunk words, return the encoded length
+static uint32_t encodeChunked(const uint16_t *in, uint32_t count, uint32_t chunk, uint16_t *out, uint32_t cap, uint32_t *consumed)
+{
+	RleEncoder enc;
+	RleEncoderInit(&enc, out, cap);
+
+	uint32_t done = 0;
+	while (done < count) {
+		uint32_t n    = count - done < chunk ? count - done : chunk;
+		uint32_t used = RleEncode(&enc, in + done, n);
+		done += used;
+		if (used < n)
+			break;
+	}
+
+	*consumed = done;
+	return enc.Len;
+}
+
+static void checkRoundTrip(const char *name, const uint16_t *in, uint32_t count, uint32_t chunk)
+{
+	uint32_t consumed;
+	uint32_t len = encodeChunked(in, count, chunk, mEnc, sizeof(mEnc) / sizeof(mEnc[0]), &consumed);
+	CHECK(consumed == count, "%s: consumed %u of %u", name, consumed, count);
+
+	uint32_t n = RleDecode(mEnc, len, mDec, TEST_MAX_WORDS);
+	CHECK(n == count, "%s: decoded %u of %u", name, n, count);
+	CHECK(memcmp(in, mDec, count * sizeof(uint16_t)) == 0, "%s: decoded data differs", name);
+}
+
+// Runs of 0x0000, 0xFFFF and random words of random length, including lone 0x0000/0xFFFF
+static uint32_t fillRandom(uint16_t *in, uint32_t count)
+{
+	uint32_t i = 0;
+	while (i < count) {
+		uint32_t kind = rand() % 3;
+		uint32_t n    = rand() % 8 == 0 ? 1 + rand() % 3000 : 1 + rand() % 8;
+		if (n > count - i)
+			n = count - i;
+		for (uint32_t j=0; j<n; j++)
+			in[i++] = kind == 0 ? 0x0000 : kind == 1 ? 0xFFFF : (uint16_t)rand();
+	}
+	return count;
+}
+
+static void testRandom(void)
+{
+	static const uint32_t chunks[] = { 1, 2, 3, 7, 64, 1000, 2048, TEST_MAX_WORDS };
+
+	srand(1);
+	for (uint32_t iter=0; iter<200; iter++) {
+		uint32_t count = 1 + rand() % TEST_MAX_WORDS;
+		fillRandom(mIn, count);
+		checkRoundTrip("random", mIn, count, chunks[iter % (sizeof(chunks) / sizeof(chunks[0]))]);
+	}
+}
+
+static void testChunkBoundary(void)
+{
+	uint32_t consumed;
+	uint32_t len;
+
+	// a run split over many calls still extends one token
+	for (uint32_t i=0; i<10000; i++)
+		mIn[i] = 0xFFFF;
+	len = encodeChunked(mIn, 10000, 1000, mEnc, 16, &consumed);
+	CHECK(consumed == 10000 && len == 1, "run over chunks: %u words consumed, %u encoded", consumed, len);
+	CHECK(mEnc[0] == (RLE_TYPE_ONES | 10000), "run over chunks: header 0x%04x", mEnc[0]);
+	checkRoundTrip("run over chunks", mIn, 10000, 1000);
+
+	// literals then a run, with the boundary inside each
+	for (uint32_t i=0; i<300; i++)
+		mIn[i] = (uint16_t)(i * 7 + 1);
+	for (uint32_t i=300; i<700; i++)
+		mIn[i] = 0x0000;
+	for (uint32_t i=700; i<1000; i++)
+		mIn[i] = (uint16_t)(i * 13 + 1);
+	for (uint32_t chunk=1; chunk<=1000; chunk += 37)
+		checkRoundTrip("mixed over chunks", mIn, 1000, chunk);
+
+	// a lone 0x0000 at the end of a call, then more zeros in the next
+	mIn[0] = 0x1234;
+	mIn[1] = 0x0000;
+	mIn[2] = 0x0000;
+	mIn[3] = 0x0000;
+	checkRoundTrip("lone word at boundary", mIn, 4, 2);
+}
+
+static void testMaxRuns(void)
+{
+	uint32_t consumed;
+	uint32_t len;
+	uint32_t count = 2 * RLE_COUNT_MASK + 5;
+
+	for (uint32_t i=0; i<count; i++)
+		mIn[i] = 0x0000;
+	len = encodeChunked(mIn, count, count, mEnc, 16, &consumed);
+	CHECK(consumed == count && len == 3, "max zero run: %u words consumed, %u encoded", consumed, len);
+	CHECK(mEnc[0] == (RLE_TYPE_ZEROS | RLE_COUNT_MASK) && mEnc[1] == (RLE_TYPE_ZEROS | RLE_COUNT_MASK)
+		  && mEnc[2] == (RLE_TYPE_ZEROS | 5), "max zero run: headers 0x%04x 0x%04x 0x%04x", mEnc[0], mEnc[1], mEnc[2]);
+	checkRoundTrip("max zero run", mIn, count, count);
+	checkRoundTrip("max zero run chunked", mIn, count, 1000);
+
+	// exactly one full token, then the type changes
+	for (uint32_t i=0; i<RLE_COUNT_MASK; i++)
+		mIn[i] = 0xFFFF;
+	mIn[RLE_COUNT_MASK] = 0x0000;
+	mIn[RLE_COUNT_MASK + 1] = 0x0000;
+	checkRoundTrip("max ones run", mIn, RLE_COUNT_MASK + 2, RLE_COUNT_MASK + 2);
+
+	// literal tokens split at the maximum count as well
+	count = RLE_COUNT_MASK + 10;
+	for (uint32_t i=0; i<count; i++)
+		mIn[i] = (uint16_t)(0x5A5A + i % 2);
+	len = encodeChunked(mIn, count, count, mEnc, sizeof(mEnc) / sizeof(mEnc[0]), &consumed);
+	CHECK(consumed == count && len == count + 2, "max literal: %u words consumed, %u encoded", consumed, len);
+	CHECK(mEnc[0] == (RLE_TYPE_LITERAL | RLE_COUNT_MASK), "max literal: header 0x%04x", mEnc[0]);
+	checkRoundTrip("max literal", mIn, count, count);
+}
+
+static void testOutputFull(void)
+{
+	srand(2);
+	fillRandom(mIn, 20000);
+
+	for (uint32_t cap=1; cap<200; cap++) {
+		for (uint32_t chunk=1; chunk<=64; chunk *= 4) {
+			uint32_t consumed;
+			uint32_t len = encodeChunked(mIn, 20000, chunk, mEnc, cap, &consumed);
+			CHECK(len <= cap, "cap %u: %u words encoded", cap, len);
+			CHECK(consumed < 20000, "cap %u: all input consumed", cap);
+
+			// the truncated output is a complete stream of exactly the consumed words
+			uint32_t n = RleDecode(mEnc, len, mDec, TEST_MAX_WORDS);
+			CHECK(n == consumed, "cap %u chunk %u: decoded %u, consumed %u", cap, chunk, n, consumed);
+			CHECK(memcmp(mIn, mDec, n * sizeof(uint16_t)) == 0, "cap %u chunk %u: decoded data differs", cap, chunk);
+		}
+	}
+
+	// once full, further calls consume nothing
+	RleEncoder enc;
+	RleEncoderInit(&enc, mEnc, 3);
+	for (uint32_t i=0; i<4; i++)
+		mIn[i] = (uint16_t)(i + 1);
+	uint32_t used = RleEncode(&enc, mIn, 4);
+	CHECK(used == 2 && enc.Len == 3, "full: %u consumed, %u encoded", used, enc.Len);
+	used = RleEncode(&enc, mIn + 2, 2);
+	CHECK(used == 0 && enc.Len == 3, "full again: %u consumed, %u encoded", used, enc.Len);
+}
+
+static void testMalformed(void)
+{
+	uint16_t bad_type[] = { 0xC001, 0x0000 };
+	uint16_t short_literal[] = { RLE_TYPE_LITERAL | 3, 0x1111, 0x2222 };
+	uint16_t too_long[] = { RLE_TYPE_ONES | 10 };
+
+	CHECK(RleDecode(bad_type, 2, mDec, 16) == 0xFFFFFFFF, "reserved token type accepted");
+	CHECK(RleDecode(short_literal, 3, mDec, 16) == 0xFFFFFFFF, "truncated literal accepted");
+	CHECK(RleDecode(too_long, 1, mDec, 9) == 0xFFFFFFFF, "output overrun accepted");
+	CHECK(RleDecode(too_long, 1, mDec, 10) == 10, "exact fit rejected");
+	CHECK(RleDecode(too_long, 0, mDec, 10) == 0, "empty stream");
+}
+
+int main(void)
+{
+	testRandom();
+	testChunkBoundary();
+	testMaxRuns();
+	testOutputFull();
+	testMalformed();
+
+	if (mFailures) {
+		printf("test_rle: %d failed\n", mFailures);
+		return 1;
+	}
+	printf("test_rle: passed\n");
+	return 0;
+}